@@ -19,21 +19,51 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <signal.h>
 #include <fcntl.h>    // write and create files
 #include <string.h>
 #include <sys/ioctl.h> // Window Size 
+#include <sys/mman.h>  // mapping files into memory
+#include <sys/file.h>  // locking journals
+#include <sys/stat.h>
 #include <termios.h>   // Terminal I/O
 #include <unistd.h>
+#include <pthread.h>
+#include <regex.h>     // line filters
+#ifdef __SSE2__
+#include <emmintrin.h> // SSE2 intrinsics for scanning rows 16 bytes at a time
+#endif
 
 /*** defines ***/
 
 
 #define TEXTEDITOR_VERSION "0.0.1"
 #define TAB_STOP 8 // width of our tab stop, default is 8 columns
+#define WRAP_IDLE_BATCH 8192 // rows reflowed per idle tick after a resize in soft wrap mode
+#define MAX_THREADS 8 // most threads a bulk operation splits its rows between
+#define PARALLEL_MIN_ROWS 65536 // bulk operations on fewer rows than this stay on one thread
+#define POOL_CHUNK_SIZE (1 << 20) // size of the chunks loaded row text is stored in
+#define POOL_KEEP_FREE 16 // free pool chunks kept for reuse rather than handed back to malloc
+#define LONGEST_HIST 65536 // row widths below this are counted in a histogram for the longest line
+#define INDEX_MIN_SIZE (1 << 20) // files smaller than this are quick enough to scan, and get no line index
+#define INDEX_CHECKPOINT_EVERY 4096 // rows between the line hashes an index is checked against
+#define DIFF_MAX_COST 1024 // edits the diff searches for before settling for a less than minimal split
+#define DIFF_MAX_WORK (1L << 24) // lines a merge's diffs compare before settling for coarser hunks
+#define JOURNAL_FLUSH_SIZE (1 << 16) // journal records held in memory before they are written out anyway
 
 /// bitwise AND with 00011111, equiv to stripping the first 3 bits, what ctrl does
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+// which of a row's buffers live in the row pool rather than their own malloc
+#define POOL_CHARS  (1<<0)
+#define POOL_RENDER (1<<1)
+
+// flags for which optional syntax classes a filetype highlights
+#define HL_HIGHLIGHT_NUMBERS (1<<0)
+#define HL_HIGHLIGHT_STRINGS (1<<1)
+
 
 enum editorKey {  
   BACKSPACE = 127,
@@ -48,45 +78,233 @@ enum editorKey {
   END_KEY
 };
 
+// highlight class of each character in a row's render string
+enum editorHighlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER
+};
+
+// state the lexer is in at the end of a row, carried into the next row
+enum editorLexState {
+  LEX_NORMAL = 0,
+  LEX_MLCOMMENT, // inside a /* */ comment
+  LEX_DQSTRING,  // inside a "string" continued with a trailing backslash
+  LEX_SQSTRING   // inside a 'string' continued with a trailing backslash
+};
+
+// kinds of record in a journal, and the numbers and text each one carries
+enum journalOp {
+  JR_INSERT_CHAR = 1, // row, at, c
+  JR_DELETE_CHAR,     // row, at
+  JR_APPEND,          // row, text to append
+  JR_TRUNCATE,        // row, new size
+  JR_INSERT_ROW,      // at, text of the row
+  JR_DELETE_ROWS,     // at, n
+  JR_INSERT_ROWS,     // at, n, followed by n JR_ROW records
+  JR_ROW,             // text of a row for JR_INSERT_ROWS
+  JR_REPLACE_ALL,     // length of find, find and repl as the text
+  JR_FILTER           // start, end, selected, command as the text
+};
+
 
 /*** prototypes ***/
 // function declarations here avoid implicit compile errors
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt);
+char *editorPrompt(char *prompt, int allowempty);
+void editorHandleResize();
+void editorWrapIdle();
+void editorCheckDisk();
+void editorJournal(int op, int a, int b, int c, const char *s, int len);
+void editorJournalIdle();
+void editorClipRows(int at, int removed, int added);
+void editorClipDetach();
+void editorJournalFlushAll();
+struct erow;
+struct diffHunk;
+void editorJournalRewrite(struct diffHunk *th, int nt, const unsigned char *conflict, struct diffHunk *oh, int no);
+void editorRenderRow(struct erow *row);
+void editorProcessKey(int c);
 
 /*** data ***/
 
+struct editorSyntax {
+  char *filetype;                 // name shown in the status bar
+  char **filematch;               // file extensions (".c") or name fragments to match
+  char **keywords;                // keywords, type keywords end with a '|'
+  char *singleline_comment_start; // NULL if the filetype has none
+  char *multiline_comment_start;
+  char *multiline_comment_end;
+  int flags;                      // HL_HIGHLIGHT_* bits
+};
+
 typedef struct erow {
   int size;      // size of our row
   int rsize;     // render size
   char *chars;   // pointer to our row's data
   char *render;  // 
+  int rcols;     // display width of render in terminal columns
+  unsigned char ascii;    // row is pure ASCII, so render columns map 1:1 to bytes
+  unsigned char *hl;      // highlight class of each render character, NULL until first highlighted
+  unsigned char hl_in;    // lexer state the row was last highlighted from
+  unsigned char hl_out;   // lexer state at the end of the row
+  unsigned char hl_dirty; // row has changed since hl was computed
+  int wrap_cols; // screen width the wrap layout was computed for, 0 if out of date
+  int wrap_h;    // number of visual lines the row wraps onto, as counted in E.buf->wrap_tree
+  int *wrap;     // column each visual line after the first starts at, NULL for ASCII rows
+  unsigned char pooled;   // POOL_* bits for the buffers that live in the row pool
+  int nchars;    // UTF-8 characters in the row
+  int nwords;    // whitespace separated words in the row
+  unsigned char stale;    // chars changed while edits were batched, render is out of date
 } erow;
 
-struct settings {
+// a chunk of memory in the row pool
+struct poolChunk {
+  struct poolChunk *next;
+  size_t used;    // bytes handed out so far
+  size_t cap;     // size of data
+  char data[];
+};
+
+// everything about one open file
+typedef struct ebuf {
   int cx, cy; 	  //cursor position in the file on row cy, column cx
   int rx;         // index in the render field (used to deal with cursor hopping over tabs)
   int rowoff;     // what row in a file is the user currently on (top of screen)
   int coloff;     // offset for columns, used to display wide files
-  int screenrows; // how many rows to display on the screen
-  int screencols; // how many cols to display
   int numrows;    // number of rows in the file
   erow *row;	  // pointer to the rows of our files
   char *filename; // the name of the file we are looking at
+  int dirty;      // a file is dirty (1) if it has unsaved changes, 0 otherwise
+  struct editorSyntax *syntax; // highlighting rules for the file, NULL for plain text
+  int hl_stale;   // every row above this index has up to date highlighting
+  int softwrap;   // long rows wrap onto several screen lines instead of scrolling
+  int wrapoff;    // in soft wrap mode, visual line of row 'rowoff' at the top of the screen
+  int *wrap_tree; // Fenwick tree over the rows' wrap_h, for prefix sums of visual lines
+  int wrap_valid; // wrap_tree matches the current rows
+  int wrap_next;  // next row to check for a stale layout while idle
+  int wrap_left;  // rows left to check while idle
+  int mark;       // row the selection is anchored at, -1 if there is no selection
+  struct poolChunk *chunks; // pool memory holding the text of the rows as loaded
+  long long bytes; // size of the file if it was saved now
+  long long chars; // characters in the file, counting newlines like wc -m
+  long long words; // words in the file
+  int longest;    // width of the longest row, in columns
+  int *widths;    // widths[w] is the number of rows w columns wide, for w < LONGEST_HIST
+  int widths_size;
+  int *longs;     // widths of the rows LONGEST_HIST columns wide or wider, sorted
+  int nlong, longs_cap;
+  int sel_start, sel_end, sel_dirty; // selection the counts below were taken for
+  long long sel_chars, sel_words, sel_bytes;
+  int batched;    // rows changed while edits were batched, see editorBatchEnd
+  int batch_first; // lowest row edited while edits were batched, INT_MAX if none
+  uint64_t *base; // line hashes of the file as last loaded or saved, what changes are merged against
+  int base_n;
+  struct stat disk; // the file on disk when base was taken
+  int disk_valid;   // disk and base are set, the buffer was loaded from or saved to its file
+  int journal_fd; // journal of the edits made since base, -1 if not open yet, -2 if it can't be
+  char *journal_path;
+  char *journal;  // records not written to the journal yet
+  size_t journal_len, journal_cap;
+  int journal_unsynced; // records have been written since the last fdatasync
+} ebuf;
+
+// the editor itself, shared by all the buffers
+struct settings {
+  int screenrows; // how many rows to display on the screen
+  int screencols; // how many cols to display
   char statusmsg[80]; // status message for the menu bar
   time_t statusmsg_time; // time the status message was printed
   struct termios origTermios;
-  int dirty;      // a file is dirty (1) if it has unsaved changes, 0 otherwise
+  ebuf *buf;      // the buffer being edited and displayed
+  ebuf **bufs;    // all open buffers
+  int numbufs;
+  int curbuf;     // index of buf in bufs
+  struct poolChunk *pool; // free chunks, ready to be reused by the next file loaded
+  int poolfree;   // number of chunks in pool
+  erow *clip;     // rows that were cut or copied
+  int clip_numrows;
+  ebuf *clip_owner; // buffer whose pool the clipboard rows' text lives in, if any
+  ebuf *clip_ref; // buffer the clipboard rows were last pasted into, if they are still there
+  int clip_at;    // row of clip_ref the pasted rows start at
+  int *macro;     // keys of the recorded macro
+  int macro_len, macro_cap;
+  int macro_pos;  // next key of the macro to replay
+  int recording;  // keys read are being added to the macro
+  int replaying;  // keys come from the macro, and the screen is not redrawn
+  int batch;      // edits only mark rows stale, see editorBatchBegin
+  int journal_off; // a journal is being replayed, so edits aren't journaled again
+  int prompting;  // a prompt is open, so rows must not be moved under its caller
 };
 
+// set by the SIGWINCH handler when the terminal is resized
+volatile sig_atomic_t winchanged = 0;
+
 struct settings E;
 
 
+/*** filetypes ***/
+
+char *C_HL_extensions[] = { ".c", ".h", ".cpp", ".cc", ".hpp", NULL };
+char *C_HL_keywords[] = {
+  "switch", "if", "while", "for", "break", "continue", "return", "else",
+  "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+  "do", "goto", "sizeof", "const", "volatile", "extern", "register",
+
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+  "void|", "short|", "size_t|", "ssize_t|", NULL
+};
+
+char *JSON_HL_extensions[] = { ".json", NULL };
+char *JSON_HL_keywords[] = { "true|", "false|", "null|", NULL };
+
+char *LOG_HL_extensions[] = { ".log", "syslog", "messages", NULL };
+char *LOG_HL_keywords[] = {
+  "ERROR", "FATAL", "CRIT", "CRITICAL", "error", "fatal",
+  "WARN|", "WARNING|", "INFO|", "DEBUG|", "TRACE|", "NOTICE|",
+  "warn|", "warning|", "info|", "debug|", NULL
+};
+
+// highlight database, the first entry whose filematch matches the filename is used
+struct editorSyntax HLDB[] = {
+  {
+    "c",
+    C_HL_extensions,
+    C_HL_keywords,
+    "//", "/*", "*/",
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+  },
+  {
+    "json",
+    JSON_HL_extensions,
+    JSON_HL_keywords,
+    NULL, NULL, NULL,
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+  },
+  {
+    "log",
+    LOG_HL_extensions,
+    LOG_HL_keywords,
+    NULL, NULL, NULL,
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+  },
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+
 /*** terminal ***/
 
 void die(const char *s) {
+  int saved = errno;
+  editorJournalFlushAll();
+  errno = saved;
   write(STDOUT_FILENO, "\x1b[2J", 4);  // clears screen <esc>[2J
   write(STDOUT_FILENO, "\x1b[H", 3);   // sets cursor to front <esc>[1;1H
   perror(s); 						   // print the error
@@ -139,12 +357,20 @@ void enableRawMode() {
 }
 
 // reads in a byte and returns the character, if an error occurs, exit the program
-int editorReadKey() {
+int editorReadTerminalKey() {
   int nread;
   char c;
   while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) 
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) 
       die("read");
+    // no key yet, use the time to catch up on any deferred work
+    if (winchanged) {
+      editorHandleResize();
+      editorRefreshScreen();
+    }
+    editorWrapIdle();
+    editorCheckDisk();
+    editorJournalIdle();
   }
 
   //if an escape character is read, read the next 2 characters
@@ -192,10 +418,27 @@ int editorReadKey() {
         }
         return '\x1b';
       } else {
-        return c;
+        // bytes of multibyte UTF-8 characters come through as 128-255
+        return (unsigned char)c;
       }
     }
 
+// reads the next key, from the macro while it is being replayed. a prompt
+// left open at the end of the macro sees an <esc>, and is cancelled
+int editorReadKey() {
+  if (E.replaying)
+    return E.macro_pos < E.macro_len ? E.macro[E.macro_pos++] : '\x1b';
+  int c = editorReadTerminalKey();
+  if (E.recording) {
+    if (E.macro_len == E.macro_cap) {
+      E.macro_cap = E.macro_cap ? E.macro_cap * 2 : 64;
+      E.macro = realloc(E.macro, sizeof(int) * E.macro_cap);
+    }
+    E.macro[E.macro_len++] = c;
+  }
+  return c;
+}
+
 // returns 0 on success, -1 on failure to get cursor position
 int getCursorPosition(int *rows, int *cols) {
   char buf[32];
@@ -253,6 +496,828 @@ if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
 
 
 
+/*** syntax highlighting ***/
+
+// true for characters that can end a number or keyword
+int is_separator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[]{}:;", c) != NULL;
+}
+
+// fills in row->hl for the row, starting the lexer in 'state' (the state the
+// previous row ended in), and records the state the row ends in
+void editorUpdateSyntax(erow *row, int state) {
+  row->hl = realloc(row->hl, row->rsize ? row->rsize : 1);
+  memset(row->hl, HL_NORMAL, row->rsize);
+  row->hl_in = state;
+  row->hl_dirty = 0;
+
+  char **keywords = E.buf->syntax->keywords;
+
+  char *scs = E.buf->syntax->singleline_comment_start;
+  char *mcs = E.buf->syntax->multiline_comment_start;
+  char *mce = E.buf->syntax->multiline_comment_end;
+
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  // the start of a row counts as a separator
+  int prev_sep = 1;
+  int in_comment = (state == LEX_MLCOMMENT);
+  int in_string = 0;      // the quote character of the string we are in
+  int continued = 0;      // string ended the row with a backslash
+  if (state == LEX_DQSTRING)
+    in_string = '"';
+  else if (state == LEX_SQSTRING)
+    in_string = '\'';
+
+  int i = 0;
+  while (i < row->rsize) {
+    unsigned char c = row->render[i];
+    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+
+    // a single line comment colors the rest of the row
+    if (scs_len && !in_string && !in_comment) {
+      if (!strncmp(&row->render[i], scs, scs_len)) {
+        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+        break;
+      }
+    }
+
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        row->hl[i] = HL_MLCOMMENT;
+        if (!strncmp(&row->render[i], mce, mce_len)) {
+          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+        } else {
+          i++;
+        }
+        continue;
+      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
+        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
+    if (E.buf->syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (in_string) {
+        row->hl[i] = HL_STRING;
+        if (c == '\\') {
+          // an escaped character, or a backslash continuing the string
+          if (i + 1 < row->rsize) {
+            row->hl[i + 1] = HL_STRING;
+            i += 2;
+          } else {
+            continued = 1;
+            i++;
+          }
+          continue;
+        }
+        if (c == in_string)
+          in_string = 0;
+        i++;
+        prev_sep = 1;
+        continue;
+      } else if (c == '"' || (c == '\'' && prev_sep)) {
+        // a quote inside a word is an apostrophe, not a string
+        in_string = c;
+        row->hl[i] = HL_STRING;
+        i++;
+        continue;
+      }
+    }
+
+    if (E.buf->syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+          (c == '.' && prev_hl == HL_NUMBER)) {
+        row->hl[i] = HL_NUMBER;
+        i++;
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    // keywords must be surrounded by separators
+    if (prev_sep) {
+      int j;
+      for (j = 0; keywords[j]; j++) {
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2)
+          klen--;
+        if (i + klen <= row->rsize &&
+            !strncmp(&row->render[i], keywords[j], klen) &&
+            is_separator((unsigned char)row->render[i + klen])) {
+          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+          i += klen;
+          break;
+        }
+      }
+      if (keywords[j] != NULL) {
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    prev_sep = is_separator(c);
+    i++;
+  }
+
+  if (in_comment)
+    row->hl_out = LEX_MLCOMMENT;
+  else if (in_string && continued)
+    row->hl_out = (in_string == '"') ? LEX_DQSTRING : LEX_SQSTRING;
+  else
+    row->hl_out = LEX_NORMAL;
+}
+
+// marks the highlighting of row 'at' and every row below it as possibly stale
+void editorInvalidateSyntax(int at) {
+  if (at < E.buf->hl_stale)
+    E.buf->hl_stale = at;
+}
+
+// brings the highlighting up to date for every row up to and including 'last'.
+// a row is only re-lexed if it was edited or the state flowing into it changed,
+// so after an edit the work stops as soon as the lexer state converges with the
+// cached state. rows below 'last' are left alone until they are needed
+void editorHighlightRows(int last) {
+  if (E.buf->syntax == NULL)
+    return;
+  if (last >= E.buf->numrows)
+    last = E.buf->numrows - 1;
+  int j;
+  for (j = E.buf->hl_stale; j <= last; j++) {
+    erow *row = &E.buf->row[j];
+    int state = (j > 0) ? E.buf->row[j - 1].hl_out : LEX_NORMAL;
+    if (row->hl_dirty || row->hl_in != state)
+      editorUpdateSyntax(row, state);
+  }
+  if (last >= E.buf->hl_stale)
+    E.buf->hl_stale = last + 1;
+}
+
+// converts a highlight class into an ANSI foreground color, -1 for the default color
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36; // cyan
+    case HL_KEYWORD1: return 33;  // yellow
+    case HL_KEYWORD2: return 32;  // green
+    case HL_STRING: return 35;    // magenta
+    case HL_NUMBER: return 31;    // red
+    default: return -1;
+  }
+}
+
+// picks the highlighting rules for the current file name
+void editorSelectSyntaxHighlight() {
+  E.buf->syntax = NULL;
+  if (E.buf->filename == NULL)
+    return;
+
+  char *ext = strrchr(E.buf->filename, '.');
+  unsigned int j;
+  for (j = 0; j < HLDB_ENTRIES; j++) {
+    struct editorSyntax *s = &HLDB[j];
+    unsigned int i = 0;
+    while (s->filematch[i]) {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(E.buf->filename, s->filematch[i]))) {
+        E.buf->syntax = s;
+        // every row has to be lexed again with the new rules
+        int filerow;
+        for (filerow = 0; filerow < E.buf->numrows; filerow++)
+          E.buf->row[filerow].hl_dirty = 1;
+        E.buf->hl_stale = 0;
+        return;
+      }
+      i++;
+    }
+  }
+}
+
+
+/*** unicode ***/
+
+// scans a row once, returning 1 if it is pure ASCII and counting its tabs.
+// most rows are plain ASCII, so this is done 16 bytes at a time where SSE2 is
+// available: a byte with its high bit set ends the fast path for the row
+int editorScanRow(const char *s, int len, int *tabs) {
+  int ascii = 1;
+  int count = 0;
+  int j = 0;
+#ifdef __SSE2__
+  const __m128i tab = _mm_set1_epi8('\t');
+  for (; j + 16 <= len; j += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + j));
+    if (_mm_movemask_epi8(v))
+      ascii = 0;
+    count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, tab)));
+  }
+#endif
+  for (; j < len; j++) {
+    if ((unsigned char)s[j] & 0x80)
+      ascii = 0;
+    else if (s[j] == '\t')
+      count++;
+  }
+  *tabs = count;
+  return ascii;
+}
+
+// decodes the UTF-8 character at the front of s, storing its code point in
+// *cp and returning how many bytes it uses. invalid or truncated sequences
+// decode as a single byte U+FFFD so the editor never gets stuck on them
+int utf8Decode(const char *s, int len, int *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  int n, c;
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  } else if ((u[0] & 0xE0) == 0xC0) {
+    n = 2;
+    c = u[0] & 0x1F;
+  } else if ((u[0] & 0xF0) == 0xE0) {
+    n = 3;
+    c = u[0] & 0x0F;
+  } else if ((u[0] & 0xF8) == 0xF0) {
+    n = 4;
+    c = u[0] & 0x07;
+  } else {
+    *cp = 0xFFFD;
+    return 1;
+  }
+  if (n > len) {
+    *cp = 0xFFFD;
+    return 1;
+  }
+  int j;
+  for (j = 1; j < n; j++) {
+    if ((u[j] & 0xC0) != 0x80) {
+      *cp = 0xFFFD;
+      return 1;
+    }
+    c = (c << 6) | (u[j] & 0x3F);
+  }
+  *cp = c;
+  return n;
+}
+
+// code point ranges, sorted, for binary searching with utf8InTable
+struct utf8Range {
+  int first, last;
+};
+
+// combining marks and zero width characters
+static const struct utf8Range utf8ZeroWidth[] = {
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x0610, 0x061A},
+  {0x064B, 0x065F}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E},
+  {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x20D0, 0x20FF},
+  {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}
+};
+
+// East Asian wide and fullwidth characters, which take two columns
+static const struct utf8Range utf8Wide[] = {
+  {0x1100, 0x115F}, {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF},
+  {0x4E00, 0x9FFF}, {0xA000, 0xA4CF}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF},
+  {0xFE30, 0xFE4F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x1F300, 0x1F64F},
+  {0x1F900, 0x1F9FF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+int utf8InTable(int cp, const struct utf8Range *table, int n) {
+  int lo = 0, hi = n - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < table[mid].first)
+      hi = mid - 1;
+    else if (cp > table[mid].last)
+      lo = mid + 1;
+    else
+      return 1;
+  }
+  return 0;
+}
+
+// number of terminal columns a code point takes up
+int utf8Width(int cp) {
+  if (cp < 0x300)
+    return 1;
+  if (utf8InTable(cp, utf8ZeroWidth, sizeof(utf8ZeroWidth) / sizeof(utf8ZeroWidth[0])))
+    return 0;
+  if (utf8InTable(cp, utf8Wide, sizeof(utf8Wide) / sizeof(utf8Wide[0])))
+    return 2;
+  return 1;
+}
+
+// width of the character at the front of s, and its length in bytes in *n
+int utf8CharWidth(const char *s, int len, int *n) {
+  int cp;
+  *n = utf8Decode(s, len, &cp);
+  return utf8Width(cp);
+}
+
+// index in row->chars of the character after the one at 'at'. combining marks
+// following a character are skipped too, so the cursor never lands between them
+int editorRowNextChar(erow *row, int at) {
+  int n;
+  if (at >= row->size)
+    return row->size;
+  if (row->ascii)
+    return at + 1;
+  utf8CharWidth(&row->chars[at], row->size - at, &n);
+  at += n;
+  while (at < row->size && utf8CharWidth(&row->chars[at], row->size - at, &n) == 0)
+    at += n;
+  return at;
+}
+
+// index in row->chars of the character before the one at 'at'
+int editorRowPrevChar(erow *row, int at) {
+  if (at <= 0)
+    return 0;
+  if (row->ascii)
+    return at - 1;
+  int n;
+  do {
+    // step back over continuation bytes to the start of the character
+    at--;
+    while (at > 0 && ((unsigned char)row->chars[at] & 0xC0) == 0x80)
+      at--;
+  } while (at > 0 && utf8CharWidth(&row->chars[at], row->size - at, &n) == 0);
+  return at;
+}
+
+// moves 'at' back to the start of the character it falls inside of
+int editorRowCharStart(erow *row, int at) {
+  if (row->ascii)
+    return at;
+  while (at > 0 && at < row->size && ((unsigned char)row->chars[at] & 0xC0) == 0x80)
+    at--;
+  return at;
+}
+
+
+/*** soft wrap ***/
+
+// display column the visual line 'line' of a laid out row starts at
+int editorRowWrapStart(erow *row, int line) {
+  if (line == 0)
+    return 0;
+  if (row->wrap == NULL)
+    return line * row->wrap_cols;
+  return row->wrap[line - 1];
+}
+
+// visual line of a laid out row that display column 'rx' falls on
+int editorRowWrapLine(erow *row, int rx) {
+  int line;
+  if (row->wrap == NULL) {
+    line = rx / row->wrap_cols;
+  } else {
+    // binary search for the last line starting at or before rx
+    int lo = 0, hi = row->wrap_h - 2;
+    line = 0;
+    while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      if (row->wrap[mid] <= rx) {
+        line = mid + 1;
+        lo = mid + 1;
+      } else {
+        hi = mid - 1;
+      }
+    }
+  }
+  return line < row->wrap_h ? line : row->wrap_h - 1;
+}
+
+// lays a row out into visual lines for the current screen width, if it
+// isn't already, and returns how many visual lines it takes up. ASCII rows
+// break every screencols columns, so only other rows store their breaks
+int editorRowLayout(erow *row) {
+  int cols = E.screencols;
+  if (row->stale)
+    editorRenderRow(row);
+  if (row->wrap_cols == cols)
+    return row->wrap_h;
+  free(row->wrap);
+  row->wrap = NULL;
+  row->wrap_cols = cols;
+  if (row->ascii) {
+    row->wrap_h = row->rcols ? (row->rcols + cols - 1) / cols : 1;
+    return row->wrap_h;
+  }
+
+  // break before any character that would not fit on the current line
+  int n = 0, cap = 0;
+  int idx = 0, col = 0, linestart = 0;
+  while (idx < row->rsize) {
+    int len;
+    int w = utf8CharWidth(&row->render[idx], row->rsize - idx, &len);
+    if (col + w - linestart > cols && col > linestart) {
+      if (n == cap) {
+        cap = cap ? cap * 2 : 4;
+        row->wrap = realloc(row->wrap, sizeof(int) * cap);
+      }
+      row->wrap[n++] = col;
+      linestart = col;
+    }
+    col += w;
+    idx += len;
+  }
+  row->wrap_h = n + 1;
+  return row->wrap_h;
+}
+
+// adds 'delta' to the height of row 'at' in the Fenwick tree
+void editorWrapTreeAdd(int at, int delta) {
+  int i;
+  for (i = at + 1; i <= E.buf->numrows; i += i & -i)
+    E.buf->wrap_tree[i] += delta;
+}
+
+// (re)builds the Fenwick tree of row heights in O(n). ASCII rows are laid
+// out exactly, which is O(1) each, other rows that are out of date get an
+// estimate from their width until they are reflowed
+void editorWrapTreeBuild() {
+  int n = E.buf->numrows;
+  int j;
+  E.buf->wrap_tree = realloc(E.buf->wrap_tree, sizeof(int) * (n + 1));
+  E.buf->wrap_tree[0] = 0;
+  for (j = 0; j < n; j++) {
+    erow *row = &E.buf->row[j];
+    if (row->wrap_cols != E.screencols) {
+      if (row->ascii)
+        editorRowLayout(row);
+      else
+        row->wrap_h = row->rcols ? (row->rcols + E.screencols - 1) / E.screencols : 1;
+    }
+    E.buf->wrap_tree[j + 1] = row->wrap_h;
+  }
+  // turn the list of heights into a Fenwick tree in place
+  for (j = 1; j <= n; j++) {
+    int parent = j + (j & -j);
+    if (parent <= n)
+      E.buf->wrap_tree[parent] += E.buf->wrap_tree[j];
+  }
+  E.buf->wrap_valid = 1;
+}
+
+void editorWrapEnsure() {
+  if (!E.buf->wrap_valid)
+    editorWrapTreeBuild();
+}
+
+// number of visual lines taken up by rows [0, at)
+int editorWrapPrefix(int at) {
+  int sum = 0;
+  int i;
+  for (i = at; i > 0; i -= i & -i)
+    sum += E.buf->wrap_tree[i];
+  return sum;
+}
+
+// finds the row that visual line 'line' belongs to in O(log n), storing
+// which of the row's visual lines it is in *sub. returns E.buf->numrows past the end
+int editorWrapFind(int line, int *sub) {
+  int pos = 0;
+  int step = 1;
+  while (step * 2 <= E.buf->numrows)
+    step *= 2;
+  for (; step > 0; step /= 2) {
+    if (pos + step <= E.buf->numrows && E.buf->wrap_tree[pos + step] <= line) {
+      pos += step;
+      line -= E.buf->wrap_tree[pos];
+    }
+  }
+  *sub = (pos < E.buf->numrows) ? line : 0;
+  return pos;
+}
+
+// lays out row 'at', keeping the tree in step if its height changed
+int editorRowHeight(int at) {
+  erow *row = &E.buf->row[at];
+  int old = row->wrap_h;
+  int h = editorRowLayout(row);
+  if (h != old && E.buf->wrap_valid)
+    editorWrapTreeAdd(at, h - old);
+  return h;
+}
+
+// reflows a batch of rows whose layout went out of date with a resize,
+// starting from the rows that were on screen at the time
+void editorWrapIdle() {
+  if (!E.buf->softwrap || !E.buf->wrap_valid)
+    return;
+  int budget = WRAP_IDLE_BATCH;
+  while (E.buf->wrap_left > 0 && budget > 0) {
+    if (E.buf->wrap_next >= E.buf->numrows)
+      E.buf->wrap_next = 0;
+    if (E.buf->wrap_next < E.buf->numrows && E.buf->row[E.buf->wrap_next].wrap_cols != E.screencols) {
+      editorRowHeight(E.buf->wrap_next);
+      budget--;
+    }
+    E.buf->wrap_next++;
+    E.buf->wrap_left--;
+  }
+}
+
+// schedules every row to be reflowed, nearest the viewport first
+void editorWrapInvalidate(ebuf *b) {
+  b->wrap_valid = 0;
+  b->wrap_next = b->rowoff;
+  b->wrap_left = b->numrows;
+}
+
+
+/*** row pool ***/
+
+// the text of every row in a file being loaded is carved out of big chunks
+// instead of being malloc'd a row at a time. each buffer keeps a list of its
+// chunks, and the chunks of a closed buffer are handed back all at once to a
+// free list shared by every buffer. rows only get their own malloc'd copy
+// of their text once they are edited
+
+// takes len bytes from the buffer's current chunk, starting a new chunk
+// (reusing a free one if there is one) when it runs out
+char *editorPoolAlloc(ebuf *b, size_t len) {
+  struct poolChunk *c = b->chunks;
+  if (c == NULL || c->cap - c->used < len) {
+    if (len > POOL_CHUNK_SIZE / 4) {
+      // very long rows get a chunk to themselves, behind the current one
+      c = malloc(sizeof(struct poolChunk) + len);
+      c->cap = len;
+      c->used = len;
+      if (b->chunks) {
+        c->next = b->chunks->next;
+        b->chunks->next = c;
+      } else {
+        c->next = NULL;
+        b->chunks = c;
+      }
+      return c->data;
+    }
+    if (E.pool) {
+      c = E.pool;
+      E.pool = c->next;
+      E.poolfree--;
+    } else {
+      c = malloc(sizeof(struct poolChunk) + POOL_CHUNK_SIZE);
+      c->cap = POOL_CHUNK_SIZE;
+    }
+    c->used = 0;
+    c->next = b->chunks;
+    b->chunks = c;
+  }
+  char *p = c->data + c->used;
+  c->used += len;
+  return p;
+}
+
+// hands all of a buffer's chunks back in one go
+void editorPoolRelease(ebuf *b) {
+  struct poolChunk *c = b->chunks;
+  while (c) {
+    struct poolChunk *next = c->next;
+    if (c->cap == POOL_CHUNK_SIZE && E.poolfree < POOL_KEEP_FREE) {
+      c->next = E.pool;
+      E.pool = c;
+      E.poolfree++;
+    } else {
+      free(c);
+    }
+    c = next;
+  }
+  b->chunks = NULL;
+}
+
+// gives a row its own copy of any text it has in the pool
+void editorRowUnpool(erow *row) {
+  if (row->pooled & POOL_CHARS) {
+    char *chars = malloc(row->size + 1);
+    memcpy(chars, row->chars, row->size + 1);
+    row->chars = chars;
+  }
+  if (row->pooled & POOL_RENDER) {
+    char *render = malloc(row->rsize + 1);
+    memcpy(render, row->render, row->rsize + 1);
+    row->render = render;
+  }
+  row->pooled = 0;
+}
+
+// makes room in row->chars for 'size' characters and the terminator,
+// moving the text out of the pool first if it is there
+void editorRowReserve(erow *row, size_t size) {
+  if (row->pooled & POOL_CHARS) {
+    char *chars = malloc(size + 1);
+    memcpy(chars, row->chars, row->size + 1);
+    row->chars = chars;
+    row->pooled &= ~POOL_CHARS;
+  } else {
+    row->chars = realloc(row->chars, size + 1);
+  }
+}
+
+
+/*** statistics ***/
+
+// counts the characters and words in a row in one pass, 16 bytes at a
+// time where SSE2 is available. a word starts at any non-space byte
+// following a space or the start of the row, and a character at any byte
+// that isn't a UTF-8 continuation byte
+int editorCountRow(const char *s, int len, int *words) {
+  int chars = 0;
+  int nwords = 0;
+  int prevspace = 1;
+  int j = 0;
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i lo = _mm_set1_epi8('\t' - 1);
+  const __m128i hi = _mm_set1_epi8('\r' + 1);
+  const __m128i top2 = _mm_set1_epi8((char)0xC0);
+  const __m128i cont = _mm_set1_epi8((char)0x80);
+  for (; j + 16 <= len; j += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + j));
+    // ' ' and '\t' to '\r' are spaces, bytes over 127 compare as negative
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+        _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi)));
+    unsigned int wsmask = _mm_movemask_epi8(ws);
+    unsigned int after_space = ((wsmask << 1) | prevspace) & 0xFFFF;
+    nwords += __builtin_popcount(~wsmask & after_space & 0xFFFF);
+    prevspace = (wsmask >> 15) & 1;
+    __m128i c = _mm_cmpeq_epi8(_mm_and_si128(v, top2), cont);
+    chars += 16 - __builtin_popcount(_mm_movemask_epi8(c));
+  }
+#endif
+  for (; j < len; j++) {
+    unsigned char c = s[j];
+    int isspace_c = (c == ' ' || (c >= '\t' && c <= '\r'));
+    if (!isspace_c && prevspace)
+      nwords++;
+    prevspace = isspace_c;
+    if ((c & 0xC0) != 0x80)
+      chars++;
+  }
+  *words = nwords;
+  return chars;
+}
+
+// index in b->longs of the first width not less than 'width'
+int editorLongFind(ebuf *b, int width) {
+  int lo = 0, hi = b->nlong;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (b->longs[mid] < width)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// counts a row of 'width' columns towards the longest line
+void editorLongestAdd(int width) {
+  ebuf *b = E.buf;
+  if (width >= LONGEST_HIST) {
+    // rows this wide are few, they are kept sorted so the next longest is
+    // known when the longest one goes
+    if (b->nlong == b->longs_cap) {
+      b->longs_cap = b->longs_cap ? b->longs_cap * 2 : 16;
+      b->longs = realloc(b->longs, sizeof(int) * b->longs_cap);
+    }
+    int at = editorLongFind(b, width);
+    memmove(&b->longs[at + 1], &b->longs[at], sizeof(int) * (b->nlong - at));
+    b->longs[at] = width;
+    b->nlong++;
+  } else {
+    if (width >= b->widths_size) {
+      int size = b->widths_size ? b->widths_size : 256;
+      while (size <= width)
+        size *= 2;
+      b->widths = realloc(b->widths, sizeof(int) * size);
+      memset(&b->widths[b->widths_size], 0, sizeof(int) * (size - b->widths_size));
+      b->widths_size = size;
+    }
+    b->widths[width]++;
+  }
+  if (width > b->longest)
+    b->longest = width;
+}
+
+// stops counting a row of 'width' columns towards the longest line
+void editorLongestSub(int width) {
+  ebuf *b = E.buf;
+  if (width >= LONGEST_HIST) {
+    int at = editorLongFind(b, width);
+    memmove(&b->longs[at], &b->longs[at + 1], sizeof(int) * (b->nlong - at - 1));
+    b->nlong--;
+    if (b->nlong > 0) {
+      b->longest = b->longs[b->nlong - 1];
+    } else {
+      // the longest row is in the histogram now
+      int j = b->widths_size - 1;
+      while (j > 0 && b->widths[j] == 0)
+        j--;
+      b->longest = j > 0 ? j : 0;
+    }
+    return;
+  }
+  b->widths[width]--;
+  // walk down to the next width that still has rows
+  if (width == b->longest && b->nlong == 0)
+    while (b->longest > 0 && b->widths[b->longest] == 0)
+      b->longest--;
+}
+
+// adds the counts of rows [start, end) to the selection's counts, or takes
+// them away if sign is -1
+void editorSelCount(int start, int end, int sign) {
+  ebuf *b = E.buf;
+  int j;
+  for (j = start; j < end; j++) {
+    b->sel_bytes += sign * (b->row[j].size + 1);
+    b->sel_chars += sign * (b->row[j].nchars + 1);
+    b->sel_words += sign * b->row[j].nwords;
+  }
+}
+
+// keeps the rows the selection's counts were taken for the same rows when n
+// rows are inserted at 'at', or -n rows removed from there. rows inserted
+// inside them are counted by editorStatsAdd, and removed rows were taken
+// away by editorStatsSub
+void editorSelShift(int at, int n) {
+  ebuf *b = E.buf;
+  if (n > 0) {
+    if (at <= b->sel_start) {
+      b->sel_start += n;
+      b->sel_end += n;
+    } else if (at < b->sel_end) {
+      b->sel_end += n;
+    }
+  } else {
+    int k = -n;
+    int d = b->sel_start - at;
+    b->sel_start -= d < 0 ? 0 : (d > k ? k : d);
+    d = b->sel_end - at;
+    b->sel_end -= d < 0 ? 0 : (d > k ? k : d);
+  }
+}
+
+// adds a row's counts to the file's counts, and to the selection's if it
+// is one of the rows they were taken for
+void editorStatsAdd(erow *row) {
+  if (E.batch) {
+    E.buf->batched = 1;
+    return;
+  }
+  E.buf->bytes += row->size + 1;
+  E.buf->chars += row->nchars + 1;
+  E.buf->words += row->nwords;
+  editorLongestAdd(row->rcols);
+  int at = row - E.buf->row;
+  if (!E.buf->sel_dirty && at >= E.buf->sel_start && at < E.buf->sel_end)
+    editorSelCount(at, at + 1, 1);
+}
+
+// takes a row's counts away from the file's counts, before it changes or goes
+void editorStatsSub(erow *row) {
+  if (E.batch) {
+    E.buf->batched = 1;
+    return;
+  }
+  E.buf->bytes -= row->size + 1;
+  E.buf->chars -= row->nchars + 1;
+  E.buf->words -= row->nwords;
+  editorLongestSub(row->rcols);
+  int at = row - E.buf->row;
+  if (!E.buf->sel_dirty && at >= E.buf->sel_start && at < E.buf->sel_end)
+    editorSelCount(at, at + 1, -1);
+}
+
+// works the file's counts out from scratch from the counts cached in each
+// row, after a load or a bulk operation. no text is scanned
+void editorStatsRebuild() {
+  ebuf *b = E.buf;
+  b->bytes = b->chars = b->words = 0;
+  b->longest = 0;
+  b->nlong = 0;
+  // the selection is counted again when it is next shown
+  b->sel_dirty = 1;
+  if (b->widths)
+    memset(b->widths, 0, sizeof(int) * b->widths_size);
+  int j;
+  for (j = 0; j < b->numrows; j++)
+    editorStatsAdd(&b->row[j]);
+}
+
+
 /*** row operations ***/
 
 // determines where to place the cursor, taking into account any tabs
@@ -260,30 +1325,92 @@ if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
 int editorRowCxToRx(erow *row, int cx) {
   int rx = 0;
   int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-    rx++;
+  if (row->ascii) {
+    for (j = 0; j < cx; j++) {
+      if (row->chars[j] == '\t')
+        rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+      rx++;
+    }
+    return rx;
+  }
+  // multibyte characters take up 0, 1 or 2 columns
+  j = 0;
+  while (j < cx) {
+    int n;
+    if (row->chars[j] == '\t') {
+      rx += TAB_STOP - (rx % TAB_STOP);
+      j++;
+    } else {
+      rx += utf8CharWidth(&row->chars[j], row->size - j, &n);
+      j += n;
+    }
   }
   return rx;
 }
 
+// converts a display column into an index into row->chars
+int editorRowRxToCx(erow *row, int rx) {
+  int cur_rx = 0;
+  int cx = 0;
+  while (cx < row->size) {
+    int n = 1, w;
+    if (row->chars[cx] == '\t')
+      w = TAB_STOP - (cur_rx % TAB_STOP);
+    else if (row->ascii)
+      w = 1;
+    else
+      w = utf8CharWidth(&row->chars[cx], row->size - cx, &n);
+    if (cur_rx + w > rx)
+      return cx;
+    cur_rx += w;
+    cx += n;
+  }
+  return cx;
+}
+
+// finds the byte index in row->render of the first character that does not
+// fit entirely before display column 'col'. *over is set to how many columns
+// of that character lie before 'col' (non zero when a wide character straddles it)
+int editorRowRenderColToIdx(erow *row, int col, int *over) {
+  *over = 0;
+  if (row->ascii)
+    return col < row->rsize ? col : row->rsize;
+  int idx = 0, cur = 0;
+  while (idx < row->rsize) {
+    int n;
+    int w = utf8CharWidth(&row->render[idx], row->rsize - idx, &n);
+    if (cur + w > col) {
+      *over = col - cur;
+      break;
+    }
+    cur += w;
+    idx += n;
+  }
+  return idx;
+}
+
 // render string is filled with characters from *row
-// tabs are replaced with multiple space characters
-void editorUpdateRow(erow *row) {
+// tabs are replaced with multiple space characters.
+// only the row itself is touched, see editorUpdateRow for rows in the file
+void editorRenderRow(erow *row) {
   int tabs = 0;
   int j;
-  // count the number of tabs
-  for(j = 0;j< row->size;j++)
-    if(row->chars[j]=='\t')
-    	tabs++;
+  // count the number of tabs, and check whether the row is pure ASCII
+  row->ascii = editorScanRow(row->chars, row->size, &tabs);
   
   // allocate enough space for all the characters, plus 8 for each tab (add 7 extras per tab)
-  free(row->render);
+  if (!(row->pooled & POOL_RENDER))
+    free(row->render);
+  row->pooled &= ~POOL_RENDER;
   row->render = malloc(row->size + tabs*(TAB_STOP-1) + 1);
   
   int idx = 0;
-  for (j = 0; j < row->size; j++) {
+  if (tabs == 0) {
+    // nothing to expand, render is a copy of the row
+    memcpy(row->render, row->chars, row->size);
+    idx = row->size;
+  } else if (row->ascii) {
+    for (j = 0; j < row->size; j++) {
 	if (row->chars[j] == '\t'){
 		// append spaces until the next tab stop is reached (every 8 columns by default)
 		row->render[idx++] = ' ';
@@ -292,137 +1419,2188 @@ void editorUpdateRow(erow *row) {
 	}else{
     row->render[idx++] = row->chars[j];
     }
-  row->render[idx] = '\0';
-  row->rsize = idx;
-  }
-}
-
+    }
+  } else {
+    // tab stops depend on display columns, which no longer match byte offsets
+    // (wide characters take 2 and combining marks 0, as for the cursor)
+    int col = 0;
+    j = 0;
+    while (j < row->size) {
+      if (row->chars[j] == '\t') {
+        row->render[idx++] = ' ';
+        col++;
+        while (col % TAB_STOP != 0) {
+          row->render[idx++] = ' ';
+          col++;
+        }
+        j++;
+      } else {
+        int n;
+        col += utf8CharWidth(&row->chars[j], row->size - j, &n);
+        memcpy(&row->render[idx], &row->chars[j], n);
+        idx += n;
+        j += n;
+      }
+    }
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+
+  // work out the width of the row in columns
+  row->rcols = row->rsize;
+  if (!row->ascii) {
+    row->rcols = 0;
+    j = 0;
+    while (j < row->rsize) {
+      int n;
+      row->rcols += utf8CharWidth(&row->render[j], row->rsize - j, &n);
+      j += n;
+    }
+  }
+
+  row->nchars = editorCountRow(row->chars, row->size, &row->nwords);
+
+  // the row needs to be lexed and laid out again before it is next drawn
+  row->hl_dirty = 1;
+  row->wrap_cols = 0;
+  row->stale = 0;
+}
+
+// rebuilds a row of the file after its chars have changed
+void editorUpdateRow(erow *row) {
+  if (E.batch) {
+    // the non-ASCII paths work for any text, so they are used until the
+    // row is rendered again
+    row->stale = 1;
+    row->ascii = 0;
+    E.buf->batched = 1;
+    if (row - E.buf->row < E.buf->batch_first)
+      E.buf->batch_first = row - E.buf->row;
+    return;
+  }
+  editorRenderRow(row);
+  editorInvalidateSyntax(row - E.buf->row);
+
+  // only this row is reflowed, the others keep their layout
+  if (E.buf->softwrap && E.buf->wrap_valid)
+    editorRowHeight(row - E.buf->row);
+}
+
+// sets up a row holding a copy of s, with no render string yet. the copy
+// is taken from the current buffer's pool if 'pooled' is set
+void editorInitRow(erow *row, const char *s, size_t len, int pooled) {
+	row->size = len;
+	row->pooled = pooled ? POOL_CHARS : 0;
+	row->chars = pooled ? editorPoolAlloc(E.buf, len + 1) : malloc(len + 1);
+	memcpy(row->chars, s, len);
+	row->chars[len] = '\0';
+
+	row->rsize = 0;
+	row->rcols = 0;
+	row->ascii = 1;
+	row->render = NULL;
+	row->hl = NULL;
+	row->hl_in = LEX_NORMAL;
+	row->hl_out = LEX_NORMAL;
+	row->hl_dirty = 1;
+	row->wrap_cols = 0;
+	row->wrap_h = 0;
+	row->wrap = NULL;
+	row->nchars = 0;
+	row->nwords = 0;
+	row->stale = 0;
+}
+
 // insert a row into our array of rows at the specified index
 void editorInsertRow(int at, char *s, size_t len) {
 	
-	if (at < 0 || at > E.numrows)
+	if (at < 0 || at > E.buf->numrows)
 		return;
 	
-	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-	
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
+	editorJournal(JR_INSERT_ROW, at, 0, 0, s, len);
+	editorClipRows(at, 0, 1);
+	E.buf->row = realloc(E.buf->row, sizeof(erow) * (E.buf->numrows + 1));
+	memmove(&E.buf->row[at + 1], &E.buf->row[at], sizeof(erow) * (E.buf->numrows - at));
 	
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	editorUpdateRow(&E.row[at]);
+	editorInitRow(&E.buf->row[at], s, len, 0);
+	// rows below have moved, so the tree of heights is rebuilt when next needed
+	E.buf->wrap_valid = 0;
+	editorUpdateRow(&E.buf->row[at]);
+	editorSelShift(at, 1);
+	editorStatsAdd(&E.buf->row[at]);
 	
-	E.numrows++;
-	E.dirty++;
+	if (E.buf->mark >= at)
+		E.buf->mark++;
+	E.buf->numrows++;
+	E.buf->dirty++;
 }
 
-// erases the data for a row
+// erases the data for a row. text in the pool is freed with its buffer
 void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
+  if (!(row->pooled & POOL_RENDER))
+    free(row->render);
+  if (!(row->pooled & POOL_CHARS))
+    free(row->chars);
+  free(row->hl);
+  free(row->wrap);
+}
+
+// removes a specified row
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.buf->numrows) return;
+  editorJournal(JR_DELETE_ROWS, at, 1, 0, NULL, 0);
+  editorClipRows(at, 1, 0);
+  editorStatsSub(&E.buf->row[at]);
+  editorSelShift(at, -1);
+  editorFreeRow(&E.buf->row[at]);
+  memmove(&E.buf->row[at], &E.buf->row[at + 1], sizeof(erow) * (E.buf->numrows - at - 1));
+  E.buf->numrows--;
+  editorInvalidateSyntax(at);
+  E.buf->wrap_valid = 0;
+  if (E.buf->mark > at)
+    E.buf->mark--;
+  E.buf->dirty++;
+}
+
+// moves rows [at, at + n) out of the file into dst with a single memmove.
+// the rows' buffers now belong to dst, nothing is copied
+void editorSpliceRowsOut(int at, int n, erow *dst) {
+  if (at < 0 || n <= 0 || at + n > E.buf->numrows)
+    return;
+  editorJournal(JR_DELETE_ROWS, at, n, 0, NULL, 0);
+  editorClipRows(at, n, 0);
+  int j;
+  for (j = at; j < at + n; j++)
+    editorStatsSub(&E.buf->row[j]);
+  editorSelShift(at, -n);
+  memcpy(dst, &E.buf->row[at], sizeof(erow) * n);
+  memmove(&E.buf->row[at], &E.buf->row[at + n], sizeof(erow) * (E.buf->numrows - at - n));
+  E.buf->numrows -= n;
+  editorInvalidateSyntax(at);
+  E.buf->wrap_valid = 0;
+  if (E.buf->mark >= at + n)
+    E.buf->mark -= n;
+  else if (E.buf->mark >= at)
+    E.buf->mark = at;
+  E.buf->dirty++;
+}
+
+// moves n rows from src into the file at index 'at' with a single memmove,
+// taking over their buffers. their render strings and layouts are kept
+void editorSpliceRowsIn(int at, erow *src, int n) {
+  if (at < 0 || at > E.buf->numrows || n <= 0)
+    return;
+  int j;
+  editorJournal(JR_INSERT_ROWS, at, n, 0, NULL, 0);
+  for (j = 0; j < n; j++)
+    editorJournal(JR_ROW, 0, 0, 0, src[j].chars, src[j].size);
+  editorClipRows(at, 0, n);
+  E.buf->row = realloc(E.buf->row, sizeof(erow) * (E.buf->numrows + n));
+  memmove(&E.buf->row[at + n], &E.buf->row[at], sizeof(erow) * (E.buf->numrows - at));
+  memcpy(&E.buf->row[at], src, sizeof(erow) * n);
+  editorSelShift(at, n);
+  // the rows may have been lexed in a different context
+  for (j = at; j < at + n; j++) {
+    E.buf->row[j].hl_dirty = 1;
+    editorStatsAdd(&E.buf->row[j]);
+  }
+  E.buf->numrows += n;
+  editorInvalidateSyntax(at);
+  E.buf->wrap_valid = 0;
+  if (E.buf->mark >= at)
+    E.buf->mark += n;
+  E.buf->dirty++;
+}
+
+// makes dst an independent copy of src
+void editorRowCopy(erow *dst, erow *src) {
+  if (src->stale)
+    editorRenderRow(src);
+  *dst = *src;
+  dst->chars = malloc(src->size + 1);
+  memcpy(dst->chars, src->chars, src->size + 1);
+  dst->render = malloc(src->rsize + 1);
+  memcpy(dst->render, src->render, src->rsize + 1);
+  dst->hl = NULL;
+  dst->hl_dirty = 1;
+  dst->wrap = NULL;
+  dst->wrap_cols = 0;
+  dst->pooled = 0;
+}
+
+// insert a character into a row
+void editorRowInsertChar(erow *row, int at, int c) {
+  // make sure the index is valid (allowed to be at the end of the row!)
+  if (at < 0 || at > row->size) 
+    at = row->size;
+  editorJournal(JR_INSERT_CHAR, row - E.buf->row, at, c, NULL, 0);
+  editorClipRows(row - E.buf->row, 1, 1);
+  editorStatsSub(row);
+  // add two characters to our row (the new character, plus a null byte
+  editorRowReserve(row, row->size + 1);
+  // move the characters after the insertion index over one
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  row->size++;
+  row->chars[at] = c;
+  editorUpdateRow(row);
+  editorStatsAdd(row);
+  E.buf->dirty++;
+}
+
+// appends a string to the end of a row (used when backspacing
+// at the start of a row, to add the row to the previous row
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorJournal(JR_APPEND, row - E.buf->row, 0, 0, s, len);
+  editorClipRows(row - E.buf->row, 1, 1);
+  editorStatsSub(row);
+  editorRowReserve(row, row->size + len);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  editorStatsAdd(row);
+  E.buf->dirty++;
+}
+
+// cuts a row short at 'size' bytes
+void editorRowTruncate(erow *row, int size) {
+  if (size < 0 || size > row->size)
+    return;
+  editorJournal(JR_TRUNCATE, row - E.buf->row, size, 0, NULL, 0);
+  editorClipRows(row - E.buf->row, 1, 1);
+  editorStatsSub(row);
+  row->size = size;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  editorStatsAdd(row);
+  E.buf->dirty++;
+}
+
+// deletes the character in index 'at' in the given row, along with the rest
+// of its bytes if it is a multibyte character
+void editorRowDelChar(erow *row, int at) {
+  // blerga
+  if (at < 0 || at >= row->size) 
+	  return;
+  int n = 1;
+  if (!row->ascii) {
+    int cp;
+    n = utf8Decode(&row->chars[at], row->size - at, &cp);
+  }
+  editorJournal(JR_DELETE_CHAR, row - E.buf->row, at, 0, NULL, 0);
+  editorClipRows(row - E.buf->row, 1, 1);
+  editorStatsSub(row);
+  memmove(&row->chars[at], &row->chars[at + n], row->size - at - n + 1);
+  row->size -= n;
+  editorUpdateRow(row);
+  editorStatsAdd(row);
+  E.buf->dirty++;
+}
+
+// from here on an edit only marks its row stale, so a long run of edits
+// renders and counts each row once, in editorBatchEnd, instead of every time
+void editorBatchBegin() {
+  E.batch = 1;
+}
+
+// catches up on the rendering, highlighting, layout and counts deferred
+// since editorBatchBegin, in every buffer that was touched
+void editorBatchEnd() {
+  ebuf *cur = E.buf;
+  int i, j;
+  E.batch = 0;
+  for (i = 0; i < E.numbufs; i++) {
+    ebuf *b = E.bufs[i];
+    if (!b->batched)
+      continue;
+    E.buf = b;
+    for (j = 0; j < b->numrows; j++)
+      if (b->row[j].stale)
+        editorRenderRow(&b->row[j]);
+    // rows rendered during the batch (to be copied or laid out) aren't
+    // stale any more, so the highlighting goes from the first row edited
+    editorInvalidateSyntax(b->batch_first);
+    b->wrap_valid = 0;
+    editorStatsRebuild();
+    b->batched = 0;
+    b->batch_first = INT_MAX;
+  }
+  E.buf = cur;
+  // rows cut during the batch may still be stale
+  for (j = 0; j < E.clip_numrows && !E.clip_ref; j++)
+    if (E.clip[j].stale)
+      editorRenderRow(&E.clip[j]);
+}
+
+
+
+/*** editor operations ***/
+
+// adds a chacter to the file at the current cursor location
+void editorInsertChar(int c) {
+  // if the cursor is at the bottom, add a new row
+  if (E.buf->cy == E.buf->numrows) {
+    editorInsertRow(E.buf->numrows, "", 0);
+  }
+  // insert the character at the position, then increment the cursor one
+  editorRowInsertChar(&E.buf->row[E.buf->cy], E.buf->cx, c);
+  E.buf->cx++;
+}
+
+// inserts a new line wherever our cursor is located
+void editorInsertNewline() {
+  if (E.buf->cx == 0) {
+	// insert a new blank line
+    editorInsertRow(E.buf->cy, "", 0);
+  } else {
+	// split the current line into two lines
+    erow *row = &E.buf->row[E.buf->cy];
+    editorInsertRow(E.buf->cy + 1, &row->chars[E.buf->cx], row->size - E.buf->cx);
+    editorRowTruncate(&E.buf->row[E.buf->cy], E.buf->cx);
+  }
+  E.buf->cy++;
+  E.buf->cx = 0;
+}
+
+void editorDelChar() {
+  if (E.buf->cy == E.buf->numrows) 
+	  return;
+  if (E.buf->cx == 0 && E.buf->cy == 0) 
+	  return;
+  erow *row = &E.buf->row[E.buf->cy];
+  
+  if (E.buf->cx > 0) {
+	// delete a character within a row, which may be several bytes long
+    int at = editorRowCharStart(row, E.buf->cx - 1);
+    editorRowDelChar(row, at);
+    E.buf->cx = at;
+  } else{
+	  // called at the start of a row, delete the current row
+	  // and append it's contents into the previous row
+	  E.buf->cx = E.buf->row[E.buf->cy - 1].size;
+	  editorRowAppendString(&E.buf->row[E.buf->cy - 1], row->chars, row->size);
+	  editorDelRow(E.buf->cy);
+	  E.buf->cy--;
+  }
+}
+
+
+/*** bulk operations ***/
+
+// a range of rows worked on by one thread of a bulk operation
+struct rowJob {
+  int start, end; // rows [start, end)
+  void *arg;      // arguments shared by every job, read only
+  long result;    // count of whatever the job did
+  int first;      // first row the job changed, -1 if none
+  int mid;        // for merges, where the second of the two runs starts
+};
+
+// how many threads to split n rows between
+int editorThreadCount(int n) {
+  if (n < PARALLEL_MIN_ROWS)
+    return 1;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1)
+    cpus = 1;
+  if (cpus > MAX_THREADS)
+    cpus = MAX_THREADS;
+  return cpus;
+}
+
+// runs fn on each of n jobs (at most MAX_THREADS) in its own thread, with
+// the calling thread taking the first
+void editorRunJobList(struct rowJob *jobs, int n, void *(*fn)(void *)) {
+  pthread_t tid[MAX_THREADS];
+  int started[MAX_THREADS];
+  int j;
+  for (j = 1; j < n; j++)
+    started[j] = pthread_create(&tid[j], NULL, fn, &jobs[j]) == 0;
+  fn(&jobs[0]);
+  for (j = 1; j < n; j++) {
+    if (started[j])
+      pthread_join(tid[j], NULL);
+    else
+      fn(&jobs[j]); // couldn't get a thread, do the work here
+  }
+}
+
+// splits rows [start, end) into equal ranges and runs fn on each range in
+// its own thread, with the calling thread taking the first range. jobs must
+// have room for MAX_THREADS entries. returns the number of jobs run
+int editorRunJobs(int start, int end, void *(*fn)(void *), void *arg, struct rowJob *jobs) {
+  int n = editorThreadCount(end - start);
+  int j;
+  for (j = 0; j < n; j++) {
+    jobs[j].start = start + (long)(end - start) * j / n;
+    jobs[j].end = start + (long)(end - start) * (j + 1) / n;
+    jobs[j].arg = arg;
+    jobs[j].result = 0;
+    jobs[j].first = -1;
+  }
+  editorRunJobList(jobs, n, fn);
+  return n;
+}
+
+struct replaceArgs {
+  const char *find;
+  int findlen;
+  const char *repl;
+  int repllen;
+};
+
+// replaces every occurrence in a range of rows. each changed row gets its
+// new contents in one allocation and its render string rebuilt once
+void *editorReplaceJob(void *p) {
+  struct rowJob *job = p;
+  struct replaceArgs *a = job->arg;
+  int *pos = NULL; // offsets of the matches in the current row
+  int cap = 0;
+  int j;
+  for (j = job->start; j < job->end; j++) {
+    erow *row = &E.buf->row[j];
+    char *end = row->chars + row->size;
+    char *c = row->chars;
+    int n = 0;
+    while ((c = memmem(c, end - c, a->find, a->findlen)) != NULL) {
+      if (n == cap) {
+        cap = cap ? cap * 2 : 16;
+        pos = realloc(pos, sizeof(int) * cap);
+      }
+      pos[n++] = c - row->chars;
+      c += a->findlen;
+    }
+    if (n == 0)
+      continue;
+
+    int size = row->size + n * (a->repllen - a->findlen);
+    char *buf = malloc(size + 1);
+    char *out = buf;
+    int from = 0;
+    int k;
+    for (k = 0; k < n; k++) {
+      memcpy(out, &row->chars[from], pos[k] - from);
+      out += pos[k] - from;
+      memcpy(out, a->repl, a->repllen);
+      out += a->repllen;
+      from = pos[k] + a->findlen;
+    }
+    memcpy(out, &row->chars[from], row->size - from);
+    buf[size] = '\0';
+
+    if (!(row->pooled & POOL_CHARS))
+      free(row->chars);
+    row->pooled &= ~POOL_CHARS;
+    row->chars = buf;
+    row->size = size;
+    editorRenderRow(row);
+    job->result += n;
+    if (job->first < 0)
+      job->first = j;
+  }
+  free(pos);
+  return NULL;
+}
+
+// replaces every occurrence of find in the file as one change, returning
+// how many there were
+long editorReplaceRows(const char *find, const char *repl) {
+  editorClipDetach();
+  struct replaceArgs args = { find, strlen(find), repl, strlen(repl) };
+  struct rowJob jobs[MAX_THREADS];
+  int n = editorRunJobs(0, E.buf->numrows, editorReplaceJob, &args, jobs);
+  long total = 0;
+  int first = -1;
+  int j;
+  for (j = 0; j < n; j++) {
+    total += jobs[j].result;
+    if (first < 0)
+      first = jobs[j].first;
+  }
+
+  if (total) {
+    char *text = malloc(args.findlen + args.repllen + 1);
+    memcpy(text, find, args.findlen);
+    memcpy(text + args.findlen, repl, args.repllen);
+    editorJournal(JR_REPLACE_ALL, args.findlen, 0, 0, text, args.findlen + args.repllen);
+    free(text);
+    // the jobs left each changed row's new counts in the row
+    editorStatsRebuild();
+    editorInvalidateSyntax(first);
+    E.buf->wrap_valid = 0;
+    E.buf->dirty++;
+    // the cursor's row may have changed under it
+    if (E.buf->cy < E.buf->numrows) {
+      erow *row = &E.buf->row[E.buf->cy];
+      if (E.buf->cx > row->size)
+        E.buf->cx = row->size;
+      E.buf->cx = editorRowCharStart(row, E.buf->cx);
+    }
+  }
+  return total;
+}
+
+// replaces every occurrence of a string in the file in a single pass over
+// the rows, split between threads on big files. the whole replacement
+// counts as one change
+void editorReplaceAll() {
+  char *find = editorPrompt("Replace: %s", 0);
+  if (find == NULL) {
+    editorSetStatusMessage("Replace aborted");
+    return;
+  }
+  char *repl = editorPrompt("Replace with: %s", 1);
+  if (repl == NULL) {
+    free(find);
+    editorSetStatusMessage("Replace aborted");
+    return;
+  }
+
+  long total = editorReplaceRows(find, repl);
+  editorSetStatusMessage("Replaced %ld occurrences of '%s'", total, find);
+  free(find);
+  free(repl);
+}
+
+
+
+/*** selection ***/
+
+// finds the rows [*start, *end) that cut and copy work on: the rows between
+// the mark and the cursor, or just the cursor's row if no mark is set.
+// returns the number of rows
+int editorGetSelection(int *start, int *end) {
+  int lo = E.buf->cy, hi = E.buf->cy;
+  if (E.buf->mark >= 0) {
+    lo = E.buf->mark < E.buf->cy ? E.buf->mark : E.buf->cy;
+    hi = E.buf->mark < E.buf->cy ? E.buf->cy : E.buf->mark;
+  }
+  if (hi >= E.buf->numrows)
+    hi = E.buf->numrows - 1;
+  *start = lo;
+  *end = hi + 1;
+  return (*end > *start) ? *end - *start : 0;
+}
+
+// counts for the selected rows. edits to the rows counted are added in as
+// they happen, so only the rows that have come into or gone out of the
+// selection since it was last shown are summed here. it is only counted
+// from scratch after a bulk operation, or if it has moved right away
+void editorSelectionStats() {
+  ebuf *b = E.buf;
+  int start, end;
+  editorGetSelection(&start, &end);
+  if (b->sel_dirty || end <= b->sel_start || start >= b->sel_end) {
+    b->sel_chars = b->sel_words = b->sel_bytes = 0;
+    editorSelCount(start, end, 1);
+  } else {
+    if (start < b->sel_start)
+      editorSelCount(start, b->sel_start, 1);
+    else
+      editorSelCount(b->sel_start, start, -1);
+    if (end > b->sel_end)
+      editorSelCount(b->sel_end, end, 1);
+    else
+      editorSelCount(end, b->sel_end, -1);
+  }
+  b->sel_start = start;
+  b->sel_end = end;
+  b->sel_dirty = 0;
+}
+
+void editorToggleMark() {
+  if (E.buf->mark >= 0) {
+    E.buf->mark = -1;
+    editorSetStatusMessage("Mark cleared");
+  } else {
+    E.buf->mark = E.buf->cy;
+    editorSetStatusMessage("Mark set");
+  }
+}
+
+void editorClipFree() {
+  int j;
+  // rows that were pasted belong to the file now
+  for (j = 0; j < E.clip_numrows && !E.clip_ref; j++)
+    editorFreeRow(&E.clip[j]);
+  free(E.clip);
+  E.clip = NULL;
+  E.clip_numrows = 0;
+  E.clip_owner = NULL;
+  E.clip_ref = NULL;
+}
+
+// gives the clipboard its own copies of the rows last pasted from it, which
+// until now it only refers to. done only when they are needed, to paste
+// them again or because the rows are about to change
+void editorClipDetach() {
+  if (E.clip_ref != E.buf)
+    return;
+  int j;
+  for (j = 0; j < E.clip_numrows; j++)
+    editorRowCopy(&E.clip[j], &E.buf->row[E.clip_at + j]);
+  E.clip_ref = NULL;
+}
+
+// called before 'removed' rows at 'at' of the current buffer are replaced
+// by 'added' rows, to keep the clipboard's reference to the rows pasted
+// from it pointing at the same rows
+void editorClipRows(int at, int removed, int added) {
+  if (E.clip_ref != E.buf)
+    return;
+  if (removed == 0 ? at <= E.clip_at : at + removed <= E.clip_at)
+    E.clip_at += added - removed;
+  else if (at < E.clip_at + E.clip_numrows)
+    editorClipDetach();
+}
+
+// copies the selected rows into the clipboard
+void editorCopyRows() {
+  int start, end;
+  int n = editorGetSelection(&start, &end);
+  if (n == 0)
+    return;
+  editorClipFree();
+  E.clip = malloc(sizeof(erow) * n);
+  int j;
+  for (j = 0; j < n; j++)
+    editorRowCopy(&E.clip[j], &E.buf->row[start + j]);
+  E.clip_numrows = n;
+  E.buf->mark = -1;
+  editorSetStatusMessage("%d lines copied", n);
+}
+
+// moves the selected rows into the clipboard in one step, without copying them
+void editorCutRows() {
+  int start, end;
+  int n = editorGetSelection(&start, &end);
+  if (n == 0)
+    return;
+  editorClipFree();
+  E.clip = malloc(sizeof(erow) * n);
+  editorSpliceRowsOut(start, n, E.clip);
+  E.clip_numrows = n;
+  // the rows' text may still be in this buffer's pool
+  E.clip_owner = E.buf;
+  E.buf->mark = -1;
+  E.buf->cy = start;
+  E.buf->cx = 0;
+  editorSetStatusMessage("%d lines cut", n);
+}
+
+// moves the clipboard rows into the file above the cursor's row. the
+// clipboard then only refers to them, they are copied if they are pasted
+// again or change
+void editorPasteRows() {
+  int n = E.clip_numrows;
+  if (n == 0)
+    return;
+  int at = E.buf->cy;
+  int j;
+  if (E.clip_ref) {
+    ebuf *cur = E.buf;
+    E.buf = E.clip_ref;
+    editorClipDetach();
+    E.buf = cur;
+  }
+  // rows with text in another buffer's pool can't outlive that buffer
+  if (E.clip_owner && E.clip_owner != E.buf)
+    for (j = 0; j < n; j++)
+      editorRowUnpool(&E.clip[j]);
+  editorSpliceRowsIn(at, E.clip, n);
+  E.clip_owner = NULL;
+  E.clip_ref = E.buf;
+  E.clip_at = at;
+  E.buf->cy = at + n;
+  E.buf->cx = 0;
+  editorSetStatusMessage("%d lines pasted", n);
+}
+
+
+/*** sort and filter ***/
+
+// a row being sorted. the sort spends most of its time moving these
+// about, so they are kept small and the rest of the key is kept apart
+struct sortItem {
+  uint64_t prefix; // the key's number, or its first bytes after those all keys share,
+                   // as a number that orders the same way as the keys
+  int row;         // index of the row in the range being sorted
+};
+
+// the key of a row being sorted
+struct sortKey {
+  const char *key; // where the key starts in the row's chars
+  int keylen;
+};
+
+struct sortArgs {
+  int numeric;    // compare the numbers keys start with, not their bytes
+  int reverse;
+  int unique;     // keep only the first of the rows with equal keys
+  int field;      // keys start at this blank separated field, counting from 1
+  int start;      // first row of the range being sorted
+  int skip;       // length of the prefix every key shares
+  struct sortKey *keys; // by row
+  struct sortItem *items;
+  struct sortItem *tmp; // scratch space the same size as items
+};
+
+struct filterArgs {
+  regex_t re;
+  int keep;       // keep the rows that match, rather than drop them
+  int start;      // first row of the range being filtered
+  unsigned char *keepflags; // set for each row that stays
+};
+
+// finds where field 'field' starts in s. like sort -k, the blanks in
+// front of a field are part of it
+const char *editorSortField(const char *s, const char *end, int field) {
+  while (--field > 0) {
+    while (s < end && isblank((unsigned char)*s))
+      s++;
+    while (s < end && !isblank((unsigned char)*s))
+      s++;
+  }
+  return s;
+}
+
+// the number at the start of s like sort -n reads it, 0 if there is none
+double editorSortNumber(const char *s, const char *end) {
+  double num = 0, scale = 1;
+  int neg = 0;
+  while (s < end && isblank((unsigned char)*s))
+    s++;
+  if (s < end && *s == '-') {
+    neg = 1;
+    s++;
+  }
+  while (s < end && isdigit((unsigned char)*s))
+    num = num * 10 + (*s++ - '0');
+  if (s < end && *s == '.') {
+    s++;
+    while (s < end && isdigit((unsigned char)*s)) {
+      scale /= 10;
+      num += (*s++ - '0') * scale;
+    }
+  }
+  return neg ? -num : num;
+}
+
+// finds the sort keys for a range of rows. numeric keys are turned into
+// their prefix straight away: flipping the sign bit of a positive double, or
+// every bit of a negative one, gives a number that orders the same way
+void *editorSortKeyJob(void *p) {
+  struct rowJob *job = p;
+  struct sortArgs *args = job->arg;
+  int j;
+  for (j = job->start; j < job->end; j++) {
+    erow *row = &E.buf->row[args->start + j];
+    const char *end = row->chars + row->size;
+    args->keys[j].key = editorSortField(row->chars, end, args->field);
+    args->keys[j].keylen = end - args->keys[j].key;
+    args->items[j].row = j;
+    if (args->numeric) {
+      double num = editorSortNumber(args->keys[j].key, end);
+      uint64_t bits;
+      if (num == 0)
+        num = 0; // -0 sorts with 0
+      memcpy(&bits, &num, sizeof(bits));
+      args->items[j].prefix = (bits >> 63) ? ~bits : bits | (1ULL << 63);
+    }
+  }
+  return NULL;
+}
+
+// packs the 8 bytes of each key after the shared prefix into a big endian
+// number, padding short keys with zeros
+void *editorSortPrefixJob(void *p) {
+  struct rowJob *job = p;
+  struct sortArgs *args = job->arg;
+  int j, k;
+  for (j = job->start; j < job->end; j++) {
+    const struct sortKey *key = &args->keys[j];
+    uint64_t prefix = 0;
+    for (k = args->skip; k < args->skip + 8; k++)
+      prefix = (prefix << 8) | (k < key->keylen ? (unsigned char)key->key[k] : 0);
+    args->items[j].prefix = prefix;
+  }
+  return NULL;
+}
+
+int editorSortCompare(const struct sortItem *x, const struct sortItem *y, const struct sortArgs *args) {
+  int c = (x->prefix > y->prefix) - (x->prefix < y->prefix);
+  // most keys differ in their first few bytes, and the row text is only
+  // looked at when they don't
+  if (c == 0 && !args->numeric) {
+    const struct sortKey *kx = &args->keys[x->row], *ky = &args->keys[y->row];
+    c = memcmp(kx->key, ky->key, kx->keylen < ky->keylen ? kx->keylen : ky->keylen);
+    if (c == 0)
+      c = (kx->keylen > ky->keylen) - (kx->keylen < ky->keylen);
+  }
+  return args->reverse ? -c : c;
+}
+
+// merges the sorted runs a[0, na) and b[0, nb) into out. rows from a go
+// first when keys are equal, which keeps the sort stable
+void editorSortMerge(struct sortItem *a, int na, struct sortItem *b, int nb,
+    struct sortItem *out, const struct sortArgs *args) {
+  while (na && nb) {
+    if (editorSortCompare(b, a, args) < 0) {
+      *out++ = *b++;
+      nb--;
+    } else {
+      *out++ = *a++;
+      na--;
+    }
+  }
+  memcpy(out, a, sizeof(struct sortItem) * na);
+  memcpy(out + na, b, sizeof(struct sortItem) * nb);
+}
+
+// sorts items[start, end) with a bottom up merge sort, using the same part
+// of tmp as scratch space. short runs are insertion sorted to begin with
+void *editorSortJob(void *p) {
+  struct rowJob *job = p;
+  struct sortArgs *args = job->arg;
+  struct sortItem *src = args->items + job->start;
+  struct sortItem *dst = args->tmp + job->start;
+  int n = job->end - job->start;
+  int i, j, width;
+  for (i = 0; i < n; i += 16) {
+    int hi = i + 16 < n ? i + 16 : n;
+    for (j = i + 1; j < hi; j++) {
+      struct sortItem item = src[j];
+      int k = j;
+      while (k > i && editorSortCompare(&item, &src[k - 1], args) < 0) {
+        src[k] = src[k - 1];
+        k--;
+      }
+      src[k] = item;
+    }
+  }
+  for (width = 16; width < n; width *= 2) {
+    for (i = 0; i < n; i += 2 * width) {
+      int mid = i + width < n ? i + width : n;
+      int hi = i + 2 * width < n ? i + 2 * width : n;
+      editorSortMerge(src + i, mid - i, src + mid, hi - mid, dst + i, args);
+    }
+    struct sortItem *swap = src;
+    src = dst;
+    dst = swap;
+  }
+  // leave the sorted run in items
+  if (src != args->items + job->start)
+    memcpy(args->items + job->start, src, sizeof(struct sortItem) * n);
+  return NULL;
+}
+
+// merges the sorted runs items[start, mid) and items[mid, end) into tmp
+void *editorSortMergeJob(void *p) {
+  struct rowJob *job = p;
+  struct sortArgs *args = job->arg;
+  editorSortMerge(args->items + job->start, job->mid - job->start,
+      args->items + job->mid, job->end - job->mid, args->tmp + job->start, args);
+  return NULL;
+}
+
+// drops the rows in [start, end) whose keep flag isn't set, closing up the
+// gaps in one pass. returns the number of rows kept
+int editorKeepRows(int start, int end, unsigned char *keepflags) {
+  int j, dst = start;
+  for (j = start; j < end; j++) {
+    if (keepflags[j - start])
+      E.buf->row[dst++] = E.buf->row[j];
+    else
+      editorFreeRow(&E.buf->row[j]);
+  }
+  memmove(&E.buf->row[dst], &E.buf->row[end], sizeof(erow) * (E.buf->numrows - end));
+  E.buf->numrows -= end - dst;
+  return dst - start;
+}
+
+// sorts rows [start, end). each thread sorts its share of the keys, then
+// pairs of sorted runs are merged in parallel until there's one. the erow
+// structs are then put in order, no text is moved. returns the number of
+// rows left, fewer than were sorted if args->unique dropped any
+int editorSortRows(int start, int end, struct sortArgs *args, unsigned char *keepflags) {
+  int n = end - start;
+  int j;
+  args->start = start;
+  args->keys = malloc(sizeof(struct sortKey) * n);
+  args->items = malloc(sizeof(struct sortItem) * n);
+  args->tmp = malloc(sizeof(struct sortItem) * n);
+  struct rowJob jobs[MAX_THREADS];
+  editorRunJobs(0, n, editorSortKeyJob, args, jobs);
+  if (!args->numeric) {
+    // keys often start the same way, timestamps in a log for instance
+    args->skip = n ? args->keys[0].keylen : 0;
+    for (j = 1; j < n && args->skip > 0; j++) {
+      int k = 0;
+      while (k < args->skip && k < args->keys[j].keylen && args->keys[j].key[k] == args->keys[0].key[k])
+        k++;
+      args->skip = k;
+    }
+    editorRunJobs(0, n, editorSortPrefixJob, args, jobs);
+  }
+  int nruns = editorRunJobs(0, n, editorSortJob, args, jobs);
+  while (nruns > 1) {
+    int m = 0;
+    for (j = 0; j < nruns; j += 2) {
+      jobs[m].start = jobs[j].start;
+      jobs[m].mid = jobs[j].end;
+      jobs[m].end = j + 1 < nruns ? jobs[j + 1].end : jobs[j].end;
+      jobs[m].arg = args;
+      m++;
+    }
+    editorRunJobList(jobs, m, editorSortMergeJob);
+    struct sortItem *swap = args->items;
+    args->items = args->tmp;
+    args->tmp = swap;
+    nruns = m;
+  }
+
+  // keys point into the rows, so duplicates are found before they move
+  for (j = 0; j < n; j++)
+    keepflags[j] = !args->unique || j == 0 ||
+      editorSortCompare(&args->items[j - 1], &args->items[j], args) != 0;
+  erow *sorted = malloc(sizeof(erow) * (n ? n : 1));
+  for (j = 0; j < n; j++)
+    sorted[j] = E.buf->row[start + args->items[j].row];
+  memcpy(&E.buf->row[start], sorted, sizeof(erow) * n);
+  free(sorted);
+  free(args->keys);
+  free(args->items);
+  free(args->tmp);
+  return editorKeepRows(start, end, keepflags);
+}
+
+// reads the options of a sort command into args. returns 0 if they don't
+// make sense
+int editorSortOptions(char *opts, struct sortArgs *args) {
+  char *tok;
+  for (tok = strtok(opts, " "); tok; tok = strtok(NULL, " ")) {
+    if (tok[0] != '-' || tok[1] == '\0')
+      return 0;
+    for (tok++; *tok; tok++) {
+      if (*tok == 'n') {
+        args->numeric = 1;
+      } else if (*tok == 'r') {
+        args->reverse = 1;
+      } else if (*tok == 'u') {
+        args->unique = 1;
+      } else if (*tok == 'k') {
+        // the field number follows, as -kN or -k N
+        char *num = tok[1] ? tok + 1 : strtok(NULL, " ");
+        if (num == NULL || (args->field = atoi(num)) < 1)
+          return 0;
+        break;
+      } else {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// sets the keep flag of each row in a range by matching it against the regex
+void *editorFilterJob(void *p) {
+  struct rowJob *job = p;
+  struct filterArgs *args = job->arg;
+  int j;
+  for (j = job->start; j < job->end; j++) {
+    int match = regexec(&args->re, E.buf->row[j].chars, 0, NULL, 0) == 0;
+    args->keepflags[j - args->start] = match == args->keep;
+  }
+  return NULL;
+}
+
+// runs a sort or filter command on rows [start, end) as one change to the
+// file, leaving what's left of them selected if they were. returns the
+// number of rows left, or -1 if the command is unknown or bad
+//   sort [-n] [-r] [-u] [-k N]   sort by bytes or numbers, from field N on
+//   uniq                         drop rows the same as the row above
+//   keep RE, drop RE             keep or drop rows matching a regex
+// rows are reordered or dropped as erow structs, their text isn't touched
+int editorRunFilter(const char *cmd, int start, int end, int selected) {
+  int n = end - start;
+  int kept = -1;
+  int j;
+  if (start < 0 || end > E.buf->numrows || n <= 0)
+    return -1;
+  editorClipDetach();
+  unsigned char *keepflags = malloc(n);
+  if (strncmp(cmd, "sort", 4) == 0 && (cmd[4] == '\0' || cmd[4] == ' ')) {
+    struct sortArgs args = { 0, 0, 0, 1, 0, 0, NULL, NULL, NULL };
+    char *opts = strdup(cmd + 4);
+    if (editorSortOptions(opts, &args))
+      kept = editorSortRows(start, end, &args, keepflags);
+    free(opts);
+  } else if (strcmp(cmd, "uniq") == 0) {
+    for (j = start; j < end; j++) {
+      erow *row = &E.buf->row[j];
+      keepflags[j - start] = j == start || row->size != row[-1].size ||
+        memcmp(row->chars, row[-1].chars, row->size) != 0;
+    }
+    kept = editorKeepRows(start, end, keepflags);
+  } else if (strncmp(cmd, "keep ", 5) == 0 || strncmp(cmd, "drop ", 5) == 0) {
+    struct filterArgs args;
+    int err = regcomp(&args.re, cmd + 5, REG_EXTENDED | REG_NOSUB);
+    if (err) {
+      char msg[64];
+      regerror(err, &args.re, msg, sizeof(msg));
+      editorSetStatusMessage("Bad regex: %s", msg);
+      free(keepflags);
+      return -1;
+    }
+    args.keep = cmd[0] == 'k';
+    args.start = start;
+    args.keepflags = keepflags;
+    struct rowJob jobs[MAX_THREADS];
+    editorRunJobs(start, end, editorFilterJob, &args, jobs);
+    regfree(&args.re);
+    kept = editorKeepRows(start, end, keepflags);
+  } else {
+    editorSetStatusMessage("Unknown filter: %s", cmd);
+  }
+  free(keepflags);
+  if (kept < 0)
+    return -1;
+  editorJournal(JR_FILTER, start, end, selected, cmd, strlen(cmd));
+
+  // the rows were lexed in a different order
+  for (j = start; j < start + kept; j++)
+    E.buf->row[j].hl_dirty = 1;
+  editorInvalidateSyntax(start);
+  E.buf->wrap_valid = 0;
+  editorStatsRebuild();
+  E.buf->dirty++;
+  // keep what's left of the range selected
+  if (selected && kept > 0) {
+    E.buf->mark = start;
+    E.buf->cy = start + kept - 1;
+  } else {
+    E.buf->mark = -1;
+    if (E.buf->cy > E.buf->numrows)
+      E.buf->cy = E.buf->numrows;
+  }
+  if (E.buf->cy < E.buf->numrows) {
+    erow *row = &E.buf->row[E.buf->cy];
+    if (E.buf->cx > row->size)
+      E.buf->cx = row->size;
+    E.buf->cx = editorRowCharStart(row, E.buf->cx);
+  } else {
+    E.buf->cx = 0;
+  }
+  return kept;
+}
+
+// prompts for a sort or filter command and runs it on the selected rows,
+// or the whole file if there's no selection
+void editorSortFilter() {
+  int start = 0, end = E.buf->numrows;
+  int selected = E.buf->mark >= 0;
+  if (selected)
+    editorGetSelection(&start, &end);
+  if (end <= start)
+    return;
+  char *cmd = editorPrompt("Filter (sort -nru -k N | uniq | keep RE | drop RE): %s", 0);
+  if (cmd == NULL)
+    return;
+  int kept = editorRunFilter(cmd, start, end, selected);
+  if (kept >= 0)
+    editorSetStatusMessage("%d lines, %d removed", kept, end - start - kept);
+  free(cmd);
+}
+
+
+/*** line index ***/
+
+// a line index is a sidecar file in the cache directory recording where every
+// line of a big file starts, so reopening the file doesn't have to search it
+// for newlines, classify its rows or hash them again. it is laid out as:
+//   struct lineIndexHeader
+//   the file's absolute path, padded to 8 bytes
+//   uint64_t offsets[numlines]  where each line starts in the file
+//   uint32_t lengths[numlines]  length of each line, without its line ending
+//   uint64_t hashes[numlines]   hash of each line, the base changes on disk are merged against
+//   uint8_t flags[numlines]     LI_* bits for each line
+// an index is only used if the file's size, mtime, inode, device and path all
+// match the header and every INDEX_CHECKPOINT_EVERY'th line still hashes the same
+#define LI_MAGIC "TEIDX02"
+#define LI_ASCII (1<<0) // line is pure ASCII
+#define LI_TABS  (1<<1) // line contains tabs
+
+struct lineIndexHeader {
+  char magic[8];
+  uint64_t size;
+  uint64_t mtime_sec;
+  uint64_t mtime_nsec;
+  uint64_t ino;
+  uint64_t dev;
+  uint64_t pathlen;
+  uint64_t numlines;
+};
+
+// 64 bit hash of a string, a word at a time
+uint64_t editorHash(const char *s, size_t len) {
+  uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+  uint64_t w;
+  size_t j = 0;
+  for (; j + 8 <= len; j += 8) {
+    memcpy(&w, s + j, 8);
+    h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 32;
+  }
+  w = 0;
+  memcpy(&w, s + j, len - j);
+  h = (h ^ w) * 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 29;
+  return h;
+}
+
+// returns the editor's cache directory, creating it if needed, or NULL if
+// there is nowhere to put it. the result has to be freed
+char *editorCacheDir() {
+  char path[PATH_MAX];
+  char *xdg = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  if (xdg && xdg[0]) {
+    snprintf(path, sizeof(path), "%s", xdg);
+  } else if (home && home[0]) {
+    snprintf(path, sizeof(path), "%s/.cache", home);
+  } else {
+    return NULL;
+  }
+  mkdir(path, 0700);
+  size_t len = strlen(path);
+  snprintf(path + len, sizeof(path) - len, "/textEditor");
+  if (mkdir(path, 0700) == -1 && errno != EEXIST)
+    return NULL;
+  return strdup(path);
+}
+
+// path of the cache file for 'filename' with the given extension, keyed by
+// a hash of the file's absolute path. *abspath is set to that absolute path.
+// returns NULL if there is no cache directory. both results have to be freed
+char *editorCachePath(const char *filename, const char *ext, char **abspath) {
+  char *dir = editorCacheDir();
+  if (dir == NULL)
+    return NULL;
+  char *real = realpath(filename, NULL);
+  if (real == NULL) {
+    free(dir);
+    return NULL;
+  }
+  size_t len = strlen(dir) + 32 + strlen(ext);
+  char *path = malloc(len);
+  snprintf(path, len, "%s/%016llx%s", dir,
+      (unsigned long long)editorHash(real, strlen(real)), ext);
+  free(dir);
+  *abspath = real;
+  return path;
+}
+
+// the flags stored in the index for a row
+int editorRowIndexFlags(erow *row) {
+  int flags = 0;
+  if (row->ascii)
+    flags |= LI_ASCII;
+  if (memchr(row->chars, '\t', row->size))
+    flags |= LI_TABS;
+  return flags;
+}
+
+// writes the line index for a file whose lines are exactly E.buf->row, starting
+// at the given offsets and with the given hashes. st is the file's stat after
+// it was read or written. failures are silent, the file just gets scanned
+// again next time
+void editorWriteIndex(const char *filename, struct stat *st, uint64_t *offsets, uint64_t *hashes) {
+  if (st->st_size < INDEX_MIN_SIZE)
+    return;
+  char *abspath;
+  char *path = editorCachePath(filename, ".idx", &abspath);
+  if (path == NULL)
+    return;
+
+  struct lineIndexHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, LI_MAGIC, sizeof(h.magic));
+  h.size = st->st_size;
+  h.mtime_sec = st->st_mtim.tv_sec;
+  h.mtime_nsec = st->st_mtim.tv_nsec;
+  h.ino = st->st_ino;
+  h.dev = st->st_dev;
+  h.pathlen = strlen(abspath);
+  h.numlines = E.buf->numrows;
+
+  size_t pathpad = (h.pathlen + 7) & ~(size_t)7;
+  size_t len = sizeof(h) + pathpad + h.numlines * (2 * sizeof(uint64_t) + sizeof(uint32_t) + 1);
+  char *buf = calloc(1, len);
+  char *p = buf;
+  memcpy(p, &h, sizeof(h));
+  p += sizeof(h);
+  memcpy(p, abspath, h.pathlen);
+  p += pathpad;
+  memcpy(p, offsets, h.numlines * sizeof(uint64_t));
+  p += h.numlines * sizeof(uint64_t);
+  uint32_t *lengths = (uint32_t *)p;
+  p += h.numlines * sizeof(uint32_t);
+  memcpy(p, hashes, h.numlines * sizeof(uint64_t));
+  p += h.numlines * sizeof(uint64_t);
+  uint8_t *flags = (uint8_t *)p;
+  int j;
+  for (j = 0; j < E.buf->numrows; j++) {
+    lengths[j] = E.buf->row[j].size;
+    flags[j] = editorRowIndexFlags(&E.buf->row[j]);
+  }
+
+  // write to a temporary file and rename it over the old index, so a
+  // half written index can never be picked up
+  size_t tmplen = strlen(path) + 32;
+  char *tmp = malloc(tmplen);
+  snprintf(tmp, tmplen, "%s.%d", path, (int)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd != -1) {
+    int ok = write(fd, buf, len) == (ssize_t)len;
+    close(fd);
+    if (!ok || rename(tmp, path) == -1)
+      unlink(tmp);
+  }
+  free(tmp);
+  free(buf);
+  free(path);
+  free(abspath);
+}
+
+// sets up a row of a file being loaded, with its text in the pool. when the
+// index says the line is ASCII without tabs, the render string would be an
+// exact copy, so it shares the row's text instead of being built
+void editorLoadRow(erow *row, const char *s, int len, int flags) {
+  editorInitRow(row, s, len, 1);
+  if ((flags & LI_ASCII) && !(flags & LI_TABS)) {
+    row->render = row->chars;
+    row->pooled |= POOL_RENDER;
+    row->rsize = len;
+    row->rcols = len;
+    row->ascii = 1;
+    row->nchars = editorCountRow(row->chars, len, &row->nwords);
+  } else {
+    editorRenderRow(row);
+  }
+}
+
+// loads the rows of a file from its line index, if it has a valid one, and
+// their hashes into *hashes. map is the whole file mapped into memory.
+// returns 1 if the rows were loaded
+int editorLoadIndexed(const char *filename, struct stat *st, const char *map, uint64_t **hashes) {
+  if (st->st_size < INDEX_MIN_SIZE)
+    return 0;
+  char *abspath;
+  char *path = editorCachePath(filename, ".idx", &abspath);
+  if (path == NULL)
+    return 0;
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if (fd == -1) {
+    free(abspath);
+    return 0;
+  }
+
+  int loaded = 0;
+  struct stat ist;
+  char *idx = MAP_FAILED;
+  if (fstat(fd, &ist) == 0 && (size_t)ist.st_size >= sizeof(struct lineIndexHeader))
+    idx = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (idx == MAP_FAILED) {
+    free(abspath);
+    return 0;
+  }
+
+  struct lineIndexHeader h;
+  memcpy(&h, idx, sizeof(h));
+  size_t pathpad = (h.pathlen + 7) & ~(size_t)7;
+  int valid = !memcmp(h.magic, LI_MAGIC, sizeof(h.magic)) &&
+      h.size == (uint64_t)st->st_size &&
+      h.mtime_sec == (uint64_t)st->st_mtim.tv_sec &&
+      h.mtime_nsec == (uint64_t)st->st_mtim.tv_nsec &&
+      h.ino == (uint64_t)st->st_ino &&
+      h.dev == (uint64_t)st->st_dev &&
+      h.numlines <= h.size + 1 && h.numlines < INT_MAX &&
+      h.pathlen == strlen(abspath) &&
+      (uint64_t)ist.st_size == sizeof(h) + pathpad +
+          h.numlines * (2 * sizeof(uint64_t) + sizeof(uint32_t) + 1) &&
+      !memcmp(idx + sizeof(h), abspath, h.pathlen);
+  free(abspath);
+
+  if (valid) {
+    const char *p = idx + sizeof(h) + pathpad;
+    const uint64_t *offsets = (const uint64_t *)p;
+    const uint32_t *lengths = (const uint32_t *)(p + h.numlines * sizeof(uint64_t));
+    const uint64_t *lhashes = (const uint64_t *)(p + h.numlines * (sizeof(uint64_t) + sizeof(uint32_t)));
+    const uint8_t *flags = (const uint8_t *)(lhashes + h.numlines);
+    uint64_t j;
+
+    // every line has to lie inside the file, and the checkpoint lines have
+    // to hash the same as when the index was written
+    for (j = 0; j < h.numlines && valid; j++) {
+      if (offsets[j] > h.size || lengths[j] > h.size - offsets[j])
+        valid = 0;
+      else if (j % INDEX_CHECKPOINT_EVERY == 0 &&
+          editorHash(map + offsets[j], lengths[j]) != lhashes[j])
+        valid = 0;
+    }
+
+    if (valid) {
+      E.buf->row = realloc(E.buf->row, sizeof(erow) * (h.numlines ? h.numlines : 1));
+      for (j = 0; j < h.numlines; j++)
+        editorLoadRow(&E.buf->row[j], map + offsets[j], lengths[j], flags[j]);
+      E.buf->numrows = h.numlines;
+      *hashes = malloc(sizeof(uint64_t) * (h.numlines ? h.numlines : 1));
+      memcpy(*hashes, lhashes, sizeof(uint64_t) * h.numlines);
+      loaded = 1;
+    }
+  }
+  munmap(idx, ist.st_size);
+  return loaded;
+}
+
+
+/*** external changes ***/
+
+// lines a[a, a + an) of one version of the file, replaced by lines
+// b[b, b + bn) in another
+struct diffHunk {
+  int a, an;
+  int b, bn;
+};
+
+struct diffState {
+  const uint64_t *a, *b; // line hashes of the two versions
+  int *vf, *vb;   // furthest x reached on each diagonal searching forwards and backwards
+  int voff;       // index of diagonal 0 in vf and vb
+  struct diffHunk *hunks;
+  int nhunks, cap;
+  long *work;     // lines left to compare before giving up on finding more hunks
+};
+
+// adds a hunk to the diff, joining it onto the last one if they touch
+void editorDiffHunk(struct diffState *d, int a, int an, int b, int bn) {
+  struct diffHunk *h = d->nhunks ? &d->hunks[d->nhunks - 1] : NULL;
+  if (h && h->a + h->an == a && h->b + h->bn == b) {
+    h->an += an;
+    h->bn += bn;
+    return;
+  }
+  if (d->nhunks == d->cap) {
+    d->cap = d->cap ? d->cap * 2 : 16;
+    d->hunks = realloc(d->hunks, sizeof(struct diffHunk) * d->cap);
+  }
+  d->hunks[d->nhunks].a = a;
+  d->hunks[d->nhunks].an = an;
+  d->hunks[d->nhunks].b = b;
+  d->hunks[d->nhunks].bn = bn;
+  d->nhunks++;
+}
+
+// finds a point (x, y) that an optimal edit path between a[a0, a1) and
+// b[b0, b1) goes through, by searching forwards from the start and backwards
+// from the end until the two meet in the middle (Myers' middle snake). only
+// two arrays of diagonals are kept, so the space used is linear. after
+// DIFF_MAX_COST edits it settles for the furthest point the forward search
+// reached. returns 0 if there's no point to split at
+int editorDiffSplit(struct diffState *d, int a0, int a1, int b0, int b1, int *x, int *y) {
+  const uint64_t *a = d->a + a0, *b = d->b + b0;
+  int n = a1 - a0, m = b1 - b0;
+  int *vf = d->vf + d->voff, *vb = d->vb + d->voff;
+  int maxd = (n + m + 1) / 2;
+  int lim = maxd < DIFF_MAX_COST ? maxd : DIFF_MAX_COST;
+  int delta = n - m;
+  int front = delta & 1; // the forward search is the one that finds the meeting
+  int kfs = 0, kfe = 0, kbs = 0, kbe = 0; // diagonals known to run off the edges
+  int best = -1;
+  int dd, k;
+  for (k = -lim - 1; k <= lim + 1; k++)
+    vf[k] = vb[k] = -1;
+  vf[1] = vb[1] = 0;
+
+  for (dd = 0; dd < maxd; dd++) {
+    if (*d->work <= 0)
+      return 0;
+    if (dd == DIFF_MAX_COST) {
+      // too far apart to be worth an exact answer
+      if (best <= 0)
+        return 0;
+      *x += a0;
+      *y += b0;
+      return 1;
+    }
+    for (k = -dd + kfs; k <= dd - kfe; k += 2) {
+      int fx = (k == -dd || (k != dd && vf[k - 1] < vf[k + 1])) ? vf[k + 1] : vf[k - 1] + 1;
+      int fy = fx - k;
+      int sx = fx;
+      while (fx < n && fy < m && a[fx] == b[fy])
+        fx++, fy++;
+      *d->work -= fx - sx + 1;
+      vf[k] = fx;
+      if (fx > n) {
+        kfe += 2;
+      } else if (fy > m) {
+        kfs += 2;
+      } else {
+        if (fx + fy > best) {
+          best = fx + fy;
+          *x = fx;
+          *y = fy;
+        }
+        int kb = delta - k;
+        if (front && kb >= -lim - 1 && kb <= lim + 1 && vb[kb] != -1 && fx >= n - vb[kb]) {
+          *x = a0 + fx;
+          *y = b0 + fy;
+          return 1;
+        }
+      }
+    }
+    for (k = -dd + kbs; k <= dd - kbe; k += 2) {
+      int bx = (k == -dd || (k != dd && vb[k - 1] < vb[k + 1])) ? vb[k + 1] : vb[k - 1] + 1;
+      int by = bx - k;
+      int sx = bx;
+      while (bx < n && by < m && a[n - bx - 1] == b[m - by - 1])
+        bx++, by++;
+      *d->work -= bx - sx + 1;
+      vb[k] = bx;
+      if (bx > n) {
+        kbe += 2;
+      } else if (by > m) {
+        kbs += 2;
+      } else {
+        int kf = delta - k;
+        if (!front && kf >= -lim - 1 && kf <= lim + 1 && vf[kf] != -1 && vf[kf] >= n - bx) {
+          *x = a0 + vf[kf];
+          *y = b0 + vf[kf] - kf;
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// diffs a[a0, a1) against b[b0, b1), adding the hunks in order
+void editorDiffRange(struct diffState *d, int a0, int a1, int b0, int b1) {
+  // lines that are the same at either end are not part of any hunk
+  while (a0 < a1 && b0 < b1 && d->a[a0] == d->b[b0])
+    a0++, b0++;
+  while (a0 < a1 && b0 < b1 && d->a[a1 - 1] == d->b[b1 - 1])
+    a1--, b1--;
+  if (a0 == a1 || b0 == b1) {
+    if (a0 < a1 || b0 < b1)
+      editorDiffHunk(d, a0, a1 - a0, b0, b1 - b0);
+    return;
+  }
+  int x, y;
+  if (!editorDiffSplit(d, a0, a1, b0, b1, &x, &y) ||
+      (x == a0 && y == b0) || (x == a1 && y == b1)) {
+    editorDiffHunk(d, a0, a1 - a0, b0, b1 - b0);
+    return;
+  }
+  editorDiffRange(d, a0, x, b0, y);
+  editorDiffRange(d, x, a1, y, b1);
+}
+
+// works out the hunks that turn the n lines hashed in a into the m lines
+// hashed in b, in order. the search is charged to *work, and once that runs
+// out whatever is left to split is returned as whole hunks, so a diff of two
+// very different files costs no more than one of two similar ones
+struct diffHunk *editorDiff(const uint64_t *a, int n, const uint64_t *b, int m, int *nhunks, long *work) {
+  struct diffState d;
+  int lim = (n + m + 1) / 2;
+  if (lim > DIFF_MAX_COST)
+    lim = DIFF_MAX_COST;
+  d.a = a;
+  d.b = b;
+  d.voff = lim + 1;
+  d.vf = malloc(sizeof(int) * (2 * lim + 3));
+  d.vb = malloc(sizeof(int) * (2 * lim + 3));
+  d.hunks = NULL;
+  d.nhunks = d.cap = 0;
+  d.work = work;
+  editorDiffRange(&d, 0, n, 0, m);
+  free(d.vf);
+  free(d.vb);
+  *nhunks = d.nhunks;
+  return d.hunks;
+}
+
+// hashes the rows of the current buffer in a range
+void *editorHashJob(void *p) {
+  struct rowJob *job = p;
+  uint64_t *hashes = job->arg;
+  int j;
+  for (j = job->start; j < job->end; j++)
+    hashes[j] = editorHash(E.buf->row[j].chars, E.buf->row[j].size);
+  return NULL;
+}
+
+// returns the hashes of the rows of the current buffer, to diff them
+uint64_t *editorHashRows() {
+  uint64_t *hashes = malloc(sizeof(uint64_t) * (E.buf->numrows ? E.buf->numrows : 1));
+  struct rowJob jobs[MAX_THREADS];
+  editorRunJobs(0, E.buf->numrows, editorHashJob, hashes, jobs);
+  return hashes;
+}
+
+// records the rows as what is in the file on disk, as described by st.
+// hashes are the rows' hashes if the caller has them already, they are
+// taken over. otherwise the rows are hashed
+void editorTakeBase(struct stat *st, uint64_t *hashes) {
+  free(E.buf->base);
+  E.buf->base = hashes ? hashes : editorHashRows();
+  E.buf->base_n = E.buf->numrows;
+  E.buf->disk = *st;
+  E.buf->disk_valid = 1;
+}
+
+// returns 1 if the current buffer's file has been changed on disk since
+// it was last loaded, saved or merged
+int editorDiskChanged() {
+  ebuf *b = E.buf;
+  struct stat st;
+  if (!b->disk_valid || b->filename == NULL || stat(b->filename, &st) == -1)
+    return 0;
+  return st.st_mtim.tv_sec != b->disk.st_mtim.tv_sec ||
+    st.st_mtim.tv_nsec != b->disk.st_mtim.tv_nsec ||
+    st.st_size != b->disk.st_size ||
+    st.st_ino != b->disk.st_ino ||
+    st.st_dev != b->disk.st_dev;
+}
+
+// where row p of the buffer ends up after the applied hunks, whose a is
+// where they were in the buffer and b where they are now. rows inside a
+// replaced hunk go to its first line
+int editorMergeMoveRow(int p, struct diffHunk *applied, int n) {
+  int j, moved = p;
+  for (j = 0; j < n; j++) {
+    if (p >= applied[j].a + applied[j].an)
+      moved = p + applied[j].b + applied[j].bn - applied[j].a - applied[j].an;
+    else if (p >= applied[j].a)
+      return applied[j].b;
+  }
+  return moved;
+}
+
+// merges the file's new contents on disk into the current buffer, like a
+// three way merge against the contents it was last loaded or saved with.
+// hunks changed only on disk are swapped into the rows in one pass, so rows
+// outside them are neither copied nor rendered again. hunks we have changed
+// too are left as ours, and counted in *conflicts. the buffer stays as
+// dirty as it was. returns the number of hunks merged, or -1 if the file
+// can't be read
+int editorMergeDisk(int *conflicts) {
+  ebuf *b = E.buf;
+  editorClipDetach();
+  *conflicts = 0;
+  int fd = open(b->filename, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  struct stat st;
+  char *map = NULL;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  // split the new contents into lines the way editorLoadScan does
+  const char **lines = NULL;
+  int *lens = NULL;
+  uint64_t *theirs = NULL;
+  int nlines = 0, cap = 0;
+  const char *p = map;
+  const char *end = map + st.st_size;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    size_t linelen = (nl ? nl : end) - p;
+    while (linelen > 0 && (p[linelen - 1] == '\n' || p[linelen - 1] == '\r'))
+      linelen--;
+    if (nlines == cap) {
+      cap = cap ? cap * 2 : 1024;
+      lines = realloc(lines, sizeof(char *) * cap);
+      lens = realloc(lens, sizeof(int) * cap);
+      theirs = realloc(theirs, sizeof(uint64_t) * cap);
+    }
+    lines[nlines] = p;
+    lens[nlines] = linelen;
+    theirs[nlines] = editorHash(p, linelen);
+    nlines++;
+    p = nl ? nl + 1 : end;
+  }
+
+  // what they changed, and what we changed if there is anything. past
+  // DIFF_MAX_WORK the hunks get coarser, and more of them conflict
+  int nt, no = 0;
+  long work = DIFF_MAX_WORK;
+  struct diffHunk *th = editorDiff(b->base, b->base_n, theirs, nlines, &nt, &work);
+  struct diffHunk *oh = NULL;
+  if (b->dirty) {
+    uint64_t *ours = editorHashRows();
+    oh = editorDiff(b->base, b->base_n, ours, b->numrows, &no, &work);
+    free(ours);
+  }
+
+  int total = b->numrows;
+  int j, k;
+  for (j = 0; j < nt; j++)
+    total += th[j].bn;
+  erow *rows = malloc(sizeof(erow) * (total ? total : 1));
+  struct diffHunk *applied = malloc(sizeof(struct diffHunk) * (nt ? nt : 1));
+  unsigned char *conflict = calloc(nt ? nt : 1, 1);
+  int napplied = 0;
+  int src = 0, dst = 0, shift = 0, oi = 0;
+  for (j = 0; j < nt; j++) {
+    struct diffHunk *t = &th[j];
+    // our hunks wholly above this one move it by the lines they add
+    while (oi < no && oh[oi].a + oh[oi].an < t->a) {
+      shift += oh[oi].bn - oh[oi].an;
+      oi++;
+    }
+    // touching or overlapping one of ours is a conflict
+    if (oi < no && oh[oi].a <= t->a + t->an) {
+      (*conflicts)++;
+      conflict[j] = 1;
+      continue;
+    }
+    int at = t->a + shift;
+    memcpy(&rows[dst], &b->row[src], sizeof(erow) * (at - src));
+    dst += at - src;
+    for (k = at; k < at + t->an; k++)
+      editorFreeRow(&b->row[k]);
+    applied[napplied].a = at;
+    applied[napplied].an = t->an;
+    applied[napplied].b = dst;
+    applied[napplied].bn = t->bn;
+    napplied++;
+    for (k = t->b; k < t->b + t->bn; k++) {
+      editorInitRow(&rows[dst], lines[k], lens[k], 0);
+      editorRenderRow(&rows[dst]);
+      dst++;
+    }
+    src = at + t->an;
+  }
+  memcpy(&rows[dst], &b->row[src], sizeof(erow) * (b->numrows - src));
+  dst += b->numrows - src;
+
+  if (napplied) {
+    b->cy = editorMergeMoveRow(b->cy, applied, napplied);
+    b->rowoff = editorMergeMoveRow(b->rowoff, applied, napplied);
+    if (b->mark >= 0)
+      b->mark = editorMergeMoveRow(b->mark, applied, napplied);
+    free(b->row);
+    b->row = rows;
+    b->numrows = dst;
+    editorInvalidateSyntax(applied[0].b);
+    b->wrap_valid = 0;
+    editorStatsRebuild();
+    if (b->cy < b->numrows) {
+      erow *row = &b->row[b->cy];
+      if (b->cx > row->size)
+        b->cx = row->size;
+      b->cx = editorRowCharStart(row, b->cx);
+    } else {
+      b->cy = b->numrows;
+      b->cx = 0;
+    }
+  } else {
+    free(rows);
+  }
+
+  // what's on disk now is what the next change is merged against, and
+  // what the journal has to start from
+  free(b->base);
+  b->base = theirs;
+  b->base_n = nlines;
+  b->disk = st;
+  editorJournalRewrite(th, nt, conflict, oh, no);
+  free(applied);
+  free(conflict);
+  free(th);
+  free(oh);
+  free(lines);
+  free(lens);
+  if (map)
+    munmap(map, st.st_size);
+  close(fd);
+  return napplied;
+}
+
+// looks for changes another program has made to the file on disk, at most
+// once a second, and merges them into the buffer
+void editorCheckDisk() {
+  static time_t last = 0;
+  // whoever opened the prompt may be holding row numbers, the change is
+  // merged at the first idle moment after it closes
+  if (E.prompting)
+    return;
+  time_t now = time(NULL);
+  if (now == last)
+    return;
+  last = now;
+  if (!editorDiskChanged())
+    return;
+  int conflicts;
+  int merged = editorMergeDisk(&conflicts);
+  if (merged < 0)
+    return;
+  editorSetStatusMessage("File changed on disk: %d changes merged, %d conflicts kept as ours", merged, conflicts);
+  editorRefreshScreen();
+}
+
+
+/*** journal ***/
+
+// a journal is a sidecar file in the cache directory holding every edit
+// made to a buffer since its file was last loaded or saved, so unsaved work
+// can be recovered after a crash. it is laid out as:
+//   struct journalHeader
+//   the file's absolute path, padded to 8 bytes
+//   records, each a uint32_t size, then uint8_t op, int32_t a, b, c and
+//   size - JR_RECORD_SIZE bytes of text
+// records are appended by the edit primitives in the order the edits were
+// made, and are only any use on top of the file they started from, which
+// the header identifies the same way a line index header does
+#define JR_MAGIC "TEJRN01"
+#define JR_RECORD_SIZE 13 // op and three numbers
+
+struct journalHeader {
+  char magic[8];
+  uint64_t size;
+  uint64_t mtime_sec;
+  uint64_t mtime_nsec;
+  uint64_t ino;
+  uint64_t dev;
+  uint64_t pathlen;
+};
+
+// a record read back from a journal
+struct journalRecord {
+  int op;
+  int32_t a, b, c;
+  const char *s; // text, pointing into the journal
+  int len;
+};
+
+// fills in a journal header for the current buffer's file as it was on disk
+// when base was taken
+void editorJournalHeader(struct journalHeader *h, const char *abspath) {
+  struct stat *st = &E.buf->disk;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, JR_MAGIC, sizeof(h->magic));
+  h->size = st->st_size;
+  h->mtime_sec = st->st_mtim.tv_sec;
+  h->mtime_nsec = st->st_mtim.tv_nsec;
+  h->ino = st->st_ino;
+  h->dev = st->st_dev;
+  h->pathlen = strlen(abspath);
 }
 
-// removes a specified row
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  E.numrows--;
-  E.dirty++;
+// opens the current buffer's journal and starts it afresh. the journal is
+// locked for as long as it is open, so the same file open in another buffer
+// or another editor doesn't write to it or take it for one left by a crash.
+// returns -1 if the buffer can't have a journal
+int editorJournalOpen() {
+  ebuf *b = E.buf;
+  char *abspath;
+  char *path = editorCachePath(b->filename, ".journal", &abspath);
+  if (path == NULL) {
+    b->journal_fd = -2;
+    return -1;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT, 0600);
+  if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) == -1) {
+    close(fd);
+    fd = -1;
+    editorSetStatusMessage("File is open elsewhere too, edits here aren't journaled");
+  } else if (fd != -1) {
+    struct journalHeader h;
+    editorJournalHeader(&h, abspath);
+    size_t pathpad = (h.pathlen + 7) & ~(size_t)7;
+    size_t len = sizeof(h) + pathpad;
+    char *buf = calloc(1, len);
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), abspath, h.pathlen);
+    if (ftruncate(fd, 0) == -1 || write(fd, buf, len) != (ssize_t)len) {
+      unlink(path);
+      close(fd);
+      fd = -1;
+    }
+    free(buf);
+  }
+  free(abspath);
+  if (fd == -1) {
+    free(path);
+    b->journal_fd = -2;
+    return -1;
+  }
+  b->journal_fd = fd;
+  b->journal_path = path;
+  b->journal_unsynced = 1;
+  return 0;
 }
 
-// insert a character into a row
-void editorRowInsertChar(erow *row, int at, int c) {
-  // make sure the index is valid (allowed to be at the end of the row!)
-  if (at < 0 || at > row->size) 
-    at = row->size;
-  // add two characters to our row (the new character, plus a null byte
-  row->chars = realloc(row->chars, row->size + 2);
-  // move the characters after the insertion index over one
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+// stops journaling a buffer whose journal couldn't be written. a journal
+// with a gap or a torn record would replay later edits against the wrong
+// text, so it is deleted rather than kept
+void editorJournalFail(ebuf *b) {
+  close(b->journal_fd);
+  unlink(b->journal_path);
+  free(b->journal_path);
+  b->journal_path = NULL;
+  b->journal_fd = -2;
+  b->journal_len = 0;
+  b->journal_unsynced = 0;
+  editorSetStatusMessage("Journal write failed (%s), edits are no longer journaled", strerror(errno));
 }
 
-// appends a string to the end of a row (used when backspacing
-// at the start of a row, to add the row to the previous row
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+// writes out the records a buffer has built up in memory
+void editorJournalFlush(ebuf *b) {
+  size_t done = 0;
+  while (b->journal_fd >= 0 && done < b->journal_len) {
+    ssize_t n = write(b->journal_fd, b->journal + done, b->journal_len - done);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n == 0)
+        errno = EIO;
+      editorJournalFail(b);
+      return;
+    }
+    done += n;
+    b->journal_unsynced = 1;
+  }
+  b->journal_len = 0;
 }
 
-// deletes the character in index 'at' in the given row
-void editorRowDelChar(erow *row, int at) {
-  // blerga
-  if (at < 0 || at >= row->size) 
-	  return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+// writes out every buffer's journal records, on the way out of die()
+void editorJournalFlushAll() {
+  int j;
+  for (j = 0; j < E.numbufs; j++)
+    if (E.bufs[j]->journal_len)
+      editorJournalFlush(E.bufs[j]);
 }
 
+// closes a buffer's journal and deletes it, once its edits are saved or
+// thrown away
+void editorJournalDiscard(ebuf *b) {
+  if (b->journal_fd >= 0) {
+    close(b->journal_fd);
+    unlink(b->journal_path);
+  }
+  free(b->journal_path);
+  b->journal_path = NULL;
+  b->journal_fd = -1;
+  b->journal_len = 0;
+  b->journal_unsynced = 0;
+}
 
+// adds a record of an edit to the current buffer's journal. a record costs
+// a copy into memory, it is written out when the editor is idle or enough
+// have built up. buffers without a file on disk aren't journaled
+void editorJournal(int op, int a, int b, int c, const char *s, int len) {
+  ebuf *buf = E.buf;
+  if (E.journal_off || !buf->disk_valid || buf->journal_fd == -2)
+    return;
+  if (buf->journal_fd == -1 && editorJournalOpen() == -1)
+    return;
+  uint32_t size = JR_RECORD_SIZE + len;
+  if (buf->journal_len + 4 + size > buf->journal_cap) {
+    buf->journal_cap = (buf->journal_len + 4 + size) * 2;
+    buf->journal = realloc(buf->journal, buf->journal_cap);
+  }
+  char *p = buf->journal + buf->journal_len;
+  int32_t nums[3] = { a, b, c };
+  memcpy(p, &size, 4);
+  p[4] = op;
+  memcpy(p + 5, nums, sizeof(nums));
+  if (len)
+    memcpy(p + 4 + JR_RECORD_SIZE, s, len);
+  buf->journal_len += 4 + size;
+  if (buf->journal_len >= JOURNAL_FLUSH_SIZE)
+    editorJournalFlush(buf);
+}
 
+// writes out every buffer's journal records while the editor is idle, and
+// makes sure they are on disk with at most one fdatasync a second
+void editorJournalIdle() {
+  static time_t lastsync = 0;
+  time_t now = time(NULL);
+  int j;
+  for (j = 0; j < E.numbufs; j++) {
+    ebuf *b = E.bufs[j];
+    if (b->journal_len)
+      editorJournalFlush(b);
+    if (b->journal_unsynced && b->journal_fd >= 0 && now != lastsync) {
+      if (fdatasync(b->journal_fd) == -1 && errno != EINVAL)
+        editorJournalFail(b);
+      else
+        b->journal_unsynced = 0;
+    }
+  }
+  lastsync = now;
+}
 
-/*** editor operations ***/
+// reads the record at 'off' of a journal's records. returns the offset of
+// the next record, or 0 if there isn't a whole record at 'off'
+size_t editorJournalRead(const char *p, size_t len, size_t off, struct journalRecord *r) {
+  uint32_t size;
+  if (off + 4 > len)
+    return 0;
+  memcpy(&size, p + off, 4);
+  if (size < JR_RECORD_SIZE || size > len - off - 4)
+    return 0;
+  int32_t nums[3];
+  r->op = (unsigned char)p[off + 4];
+  memcpy(nums, p + off + 5, sizeof(nums));
+  r->a = nums[0];
+  r->b = nums[1];
+  r->c = nums[2];
+  r->s = p + off + 4 + JR_RECORD_SIZE;
+  r->len = size - JR_RECORD_SIZE;
+  return off + 4 + size;
+}
 
-// adds a chacter to the file at the current cursor location
-void editorInsertChar(int c) {
-  // if the cursor is at the bottom, add a new row
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+// redoes the edit in the record at 'off', through the same primitives that
+// made it. returns the offset of the next record, or 0 if the record is cut
+// short or doesn't fit the rows, which ends the replay there
+size_t editorJournalApply(const char *p, size_t len, size_t off) {
+  struct journalRecord r;
+  size_t next = editorJournalRead(p, len, off, &r);
+  if (next == 0)
+    return 0;
+  ebuf *b = E.buf;
+  erow *row = r.a >= 0 && r.a < b->numrows ? &b->row[r.a] : NULL;
+  int j;
+  switch (r.op) {
+    case JR_INSERT_CHAR:
+      if (row == NULL)
+        return 0;
+      editorRowInsertChar(row, r.b, r.c);
+      break;
+    case JR_DELETE_CHAR:
+      if (row == NULL)
+        return 0;
+      editorRowDelChar(row, r.b);
+      break;
+    case JR_APPEND:
+      if (row == NULL)
+        return 0;
+      editorRowAppendString(row, (char *)r.s, r.len);
+      break;
+    case JR_TRUNCATE:
+      if (row == NULL)
+        return 0;
+      editorRowTruncate(row, r.b);
+      break;
+    case JR_INSERT_ROW:
+      if (r.a < 0 || r.a > b->numrows)
+        return 0;
+      editorInsertRow(r.a, (char *)r.s, r.len);
+      break;
+    case JR_DELETE_ROWS: {
+      if (r.a < 0 || r.b <= 0 || r.a + r.b > b->numrows)
+        return 0;
+      erow *rows = malloc(sizeof(erow) * r.b);
+      editorSpliceRowsOut(r.a, r.b, rows);
+      for (j = 0; j < r.b; j++)
+        editorFreeRow(&rows[j]);
+      free(rows);
+      break;
+    }
+    case JR_INSERT_ROWS: {
+      // the rows' text follows, all of it has to be there
+      if (r.a < 0 || r.a > b->numrows || r.b <= 0)
+        return 0;
+      struct journalRecord text;
+      size_t end = next;
+      for (j = 0; j < r.b; j++) {
+        end = editorJournalRead(p, len, end, &text);
+        if (end == 0 || text.op != JR_ROW)
+          return 0;
+      }
+      erow *rows = malloc(sizeof(erow) * r.b);
+      for (j = 0; j < r.b; j++) {
+        next = editorJournalRead(p, len, next, &text);
+        editorInitRow(&rows[j], text.s, text.len, 0);
+        editorRenderRow(&rows[j]);
+      }
+      editorSpliceRowsIn(r.a, rows, r.b);
+      free(rows);
+      break;
+    }
+    case JR_REPLACE_ALL: {
+      if (r.a <= 0 || r.a > r.len)
+        return 0;
+      char *find = strndup(r.s, r.a);
+      char *repl = strndup(r.s + r.a, r.len - r.a);
+      editorReplaceRows(find, repl);
+      free(find);
+      free(repl);
+      break;
+    }
+    case JR_FILTER: {
+      char *cmd = strndup(r.s, r.len);
+      int kept = editorRunFilter(cmd, r.a, r.b, r.c);
+      free(cmd);
+      if (kept < 0)
+        return 0;
+      break;
+    }
+    default:
+      return 0;
   }
-  // insert the character at the position, then increment the cursor one
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  return next;
 }
 
-// inserts a new line wherever our cursor is located
-void editorInsertNewline() {
-  if (E.cx == 0) {
-	// insert a new blank line
-    editorInsertRow(E.cy, "", 0);
-  } else {
-	// split the current line into two lines
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+// looks for a journal left by a session that ended without saving the
+// current buffer, and offers to redo its edits. they are replayed in batch
+// mode and not journaled again, and the journal carries on from where they
+// end. a journal for another version of the file is of no use and ignored
+void editorJournalRecover() {
+  ebuf *b = E.buf;
+  char *abspath;
+  char *path = editorCachePath(b->filename, ".journal", &abspath);
+  if (path == NULL)
+    return;
+  // a journal that is locked belongs to a buffer that is still open
+  int fd = open(path, O_RDWR);
+  struct stat st;
+  char *map = MAP_FAILED;
+  if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) == 0 &&
+      fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct journalHeader))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    if (fd != -1)
+      close(fd);
+    free(path);
+    free(abspath);
+    return;
+  }
+
+  struct journalHeader h, want;
+  memcpy(&h, map, sizeof(h));
+  editorJournalHeader(&want, abspath);
+  size_t hlen = sizeof(h) + ((h.pathlen + 7) & ~(size_t)7);
+  int valid = !memcmp(&h, &want, sizeof(h)) && hlen <= (size_t)st.st_size &&
+      !memcmp(map + sizeof(h), abspath, h.pathlen);
+  const char *recs = map + hlen;
+  size_t len = st.st_size - hlen;
+  long nrecs = 0;
+  size_t off = 0;
+  struct journalRecord r;
+  while (valid && (off = editorJournalRead(recs, len, off, &r)) != 0)
+    if (r.op != JR_ROW)
+      nrecs++;
+
+  if (valid && nrecs > 0) {
+    char prompt[96];
+    snprintf(prompt, sizeof(prompt), "Recover %ld unsaved edits from the journal? (y/n): %%s", nrecs);
+    char *answer = editorPrompt(prompt, 1);
+    if (answer && (answer[0] == 'y' || answer[0] == 'Y')) {
+      long n = 0;
+      size_t next;
+      off = 0;
+      E.journal_off = 1;
+      editorBatchBegin();
+      while ((next = editorJournalApply(recs, len, off)) != 0) {
+        off = next;
+        n++;
+      }
+      editorBatchEnd();
+      E.journal_off = 0;
+      // carry on with the same journal, still locked, dropping anything
+      // after the last edit that could be redone
+      if (ftruncate(fd, hlen + off) == 0 && lseek(fd, 0, SEEK_END) != -1) {
+        b->journal_fd = fd;
+        b->journal_path = path;
+        b->journal_unsynced = 1;
+        fd = -1;
+        path = NULL;
+      } else {
+        // a new journal would be missing the recovered edits
+        unlink(path);
+        b->journal_fd = -2;
+      }
+      editorSetStatusMessage("Recovered %ld of %ld edits", n, nrecs);
+    } else {
+      unlink(path);
+      editorSetStatusMessage("Journal discarded");
+    }
+    free(answer);
+  } else if (valid) {
+    unlink(path);
   }
-  E.cy++;
-  E.cx = 0;
+  munmap(map, st.st_size);
+  if (fd != -1)
+    close(fd);
+  free(path);
+  free(abspath);
 }
 
-void editorDelChar() {
-  if (E.cy == E.numrows) 
-	  return;
-  if (E.cx == 0 && E.cy == 0) 
-	  return;
-  erow *row = &E.row[E.cy];
-  
-  if (E.cx > 0) {
-	// delete a character within a row
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else{
-	  // called at the start of a row, delete the current row
-	  // and append it's contents into the previous row
-	  E.cx = E.row[E.cy - 1].size;
-	  editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-	  editorDelRow(E.cy);
-	  E.cy--;
+// starts the journal again from the file on disk after it was merged into
+// the buffer. th and oh are the hunks from the old base to the file and to
+// the buffer before the merge, and conflict marks the hunks of th that
+// weren't applied. the rows only differ from the file where our hunks and
+// the conflicts lie, and each stretch of the old base they cover is written
+// as a delete of the file's lines and an insert of ours, in the order they
+// can be redone. nothing is diffed again
+void editorJournalRewrite(struct diffHunk *th, int nt, const unsigned char *conflict, struct diffHunk *oh, int no) {
+  ebuf *b = E.buf;
+  editorJournalDiscard(b);
+  int i = 0, j = 0, k;
+  int shift = 0; // lines the hunks above the next stretch have added to the buffer
+  while (i < no || j < nt) {
+    // a hunk of theirs that was applied is the same in the file and the buffer
+    if (j < nt && !conflict[j] && (i == no || th[j].a < oh[i].a)) {
+      shift += th[j].bn - th[j].an;
+      j++;
+      continue;
+    }
+    // gather the hunks that overlap or touch into one stretch of the old base
+    int start = (i < no && (j == nt || oh[i].a <= th[j].a)) ? oh[i].a : th[j].a;
+    int end = start;
+    int tdelta = 0, odelta = 0; // lines the stretch gains in the file, and in the buffer
+    while (1) {
+      struct diffHunk *h;
+      if (i < no && oh[i].a <= end) {
+        h = &oh[i++];
+        odelta += h->bn - h->an;
+      } else if (j < nt && th[j].a <= end) {
+        h = &th[j];
+        tdelta += h->bn - h->an;
+        if (!conflict[j])
+          odelta += h->bn - h->an;
+        j++;
+      } else {
+        break;
+      }
+      if (h->a + h->an > end)
+        end = h->a + h->an;
+    }
+    int at = start + shift;
+    int tlen = end - start + tdelta, olen = end - start + odelta;
+    if (tlen)
+      editorJournal(JR_DELETE_ROWS, at, tlen, 0, NULL, 0);
+    if (olen) {
+      editorJournal(JR_INSERT_ROWS, at, olen, 0, NULL, 0);
+      for (k = at; k < at + olen; k++)
+        editorJournal(JR_ROW, 0, 0, 0, b->row[k].chars, b->row[k].size);
+    }
+    shift += odelta;
   }
 }
 
@@ -434,67 +3612,151 @@ char *convertRowsToString(int *buflen) {
   int totlen = 0;
   int j;
   // add up the lenghts of each row, plus 1 for the newline char on each row
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
+  for (j = 0; j < E.buf->numrows; j++)
+    totlen += E.buf->row[j].size + 1;
   *buflen = totlen;
   char *buf = malloc(totlen);
   char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
+  for (j = 0; j < E.buf->numrows; j++) {
+    memcpy(p, E.buf->row[j].chars, E.buf->row[j].size);
+    p += E.buf->row[j].size;
     *p = '\n';
     p++;
   }
   return buf;
 }
 
-// opens a file, passed as the first arg when running the program
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
-  
-  FILE *fp = fopen(filename, "r");
-  if (!fp) 
-    die("fopen");
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+// loads the rows of a file by searching it for line endings, recording
+// where each line starts and its hash for the line index
+void editorLoadScan(const char *map, size_t size, uint64_t **offsets, uint64_t **hashes) {
+  int cap = 0;
+  const char *p = map;
+  const char *end = map + size;
+  *offsets = NULL;
+  *hashes = NULL;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *next = nl ? nl + 1 : end;
+    size_t linelen = (nl ? nl : end) - p;
+    while (linelen > 0 && (p[linelen - 1] == '\n' || p[linelen - 1] == '\r'))
+      linelen--;
+    if (E.buf->numrows == cap) {
+      cap = cap ? cap * 2 : 1024;
+      E.buf->row = realloc(E.buf->row, sizeof(erow) * cap);
+      *offsets = realloc(*offsets, sizeof(uint64_t) * cap);
+      *hashes = realloc(*hashes, sizeof(uint64_t) * cap);
+    }
+    (*offsets)[E.buf->numrows] = p - map;
+    (*hashes)[E.buf->numrows] = editorHash(p, linelen);
+    // classified here so plain ASCII rows share their pooled text as the
+    // render, as they do when loaded from the index
+    int tabs;
+    int flags = editorScanRow(p, linelen, &tabs) ? LI_ASCII : 0;
+    if (tabs)
+      flags |= LI_TABS;
+    editorLoadRow(&E.buf->row[E.buf->numrows], p, linelen, flags);
+    E.buf->numrows++;
+    p = next;
+  }
+}
+
+// opens a file into the current buffer, passed as the first arg when running
+// the program. returns -1 with errno set if the file can't be read
+int editorOpen(char *filename) {
+  free(E.buf->filename);
+  E.buf->filename = strdup(filename);
+  editorSelectSyntaxHighlight();
   
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-      while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                             line[linelen - 1] == '\r'))
-        linelen--;
-      editorInsertRow(E.numrows, line, linelen);
-    }
-  free(line);
-  fclose(fp);
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) 
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || S_ISDIR(st.st_mode)) {
+    if (S_ISDIR(st.st_mode))
+      errno = EISDIR;
+    close(fd);
+    return -1;
+  }
+
+  char *map = NULL;
+  if (st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+  }
+
+  // use the line index from an earlier open if there is a valid one,
+  // otherwise scan the file and leave an index for next time
+  uint64_t *hashes = NULL;
+  if (map && !editorLoadIndexed(filename, &st, map, &hashes)) {
+    uint64_t *offsets;
+    editorLoadScan(map, st.st_size, &offsets, &hashes);
+    editorWriteIndex(filename, &st, offsets, hashes);
+    free(offsets);
+  }
+  if (map)
+    munmap(map, st.st_size);
+  close(fd);
+  E.buf->wrap_valid = 0;
+  editorStatsRebuild();
+  editorTakeBase(&st, hashes);
   // file is just opened, not dirty!
-  E.dirty = 0; 
+  E.buf->dirty = 0; 
+  editorJournalRecover();
+  return 0;
 }
 
 // saves the file
 void editorSave() {
-  if (E.filename == NULL) {
-	    E.filename = editorPrompt("Save File As: %s");
-	    if (E.filename == NULL){
+  if (E.buf->filename == NULL) {
+	    E.buf->filename = editorPrompt("Save File As: %s", 0);
+	    if (E.buf->filename == NULL){
 	    	editorSetStatusMessage("Save aborted");
 	    	return;
 	    }
+	    editorSelectSyntaxHighlight();
+  }
+  // don't overwrite changes made by another program without showing them first
+  int conflicts;
+  if (editorDiskChanged() && editorMergeDisk(&conflicts) >= 0) {
+    editorSetStatusMessage("Changed on disk and merged, %d conflicts kept ours. Ctrl-S again to save", conflicts);
+    return;
   }
   int len;
   // get a string to write to the new file
   char *buf = convertRowsToString(&len);
   // open the file, or create a new file with the correct file name
   // the owner gets r/w access, other people only get read access with permission code 0644
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+  int fd = open(E.buf->filename, O_RDWR | O_CREAT, 0644);
   if (fd != -1) {
 	  // shortens the file size to exactly the required length
 	  if (ftruncate(fd, len) != -1) {
         if (write(fd, buf, len) == len) {
+        	// the rows are now the file's lines, so index them for next time
+        	struct stat st;
+        	int statok = fstat(fd, &st) == 0;
+        	if (statok)
+        	  editorTakeBase(&st, NULL);
+        	// everything in the journal is in the file now
+        	editorJournalDiscard(E.buf);
+        	if (len >= INDEX_MIN_SIZE && statok) {
+        	  uint64_t *offsets = malloc(sizeof(uint64_t) * (E.buf->numrows ? E.buf->numrows : 1));
+        	  uint64_t off = 0;
+        	  int j;
+        	  for (j = 0; j < E.buf->numrows; j++) {
+        	    offsets[j] = off;
+        	    off += E.buf->row[j].size + 1;
+        	  }
+        	  editorWriteIndex(E.buf->filename, &st, offsets, E.buf->base);
+        	  free(offsets);
+        	}
         	close(fd);
         	free(buf);
             // file is saved correctly, not dirty
-        	E.dirty = 0;
+        	E.buf->dirty = 0;
             editorSetStatusMessage("%d bytes written to disk", len);
             return;
         }
@@ -507,6 +3769,159 @@ void editorSave() {
 
 
 
+/*** buffers ***/
+
+// makes a new, empty buffer
+ebuf *editorNewBuffer() {
+  ebuf *b = malloc(sizeof(ebuf));
+
+  // sets cursor to top left of screen
+  b->cx = 0;
+  b->cy = 0; 
+  b->rx = 0;
+  
+  b->rowoff = 0;
+  b->coloff = 0;
+  b->numrows = 0;
+  b->row = NULL;
+  b->filename = NULL;
+  
+  b->dirty = 0;
+  b->syntax = NULL;
+  b->hl_stale = 0;
+
+  b->softwrap = 0;
+  b->wrapoff = 0;
+  b->wrap_tree = NULL;
+  b->wrap_valid = 0;
+  b->wrap_next = 0;
+  b->wrap_left = 0;
+
+  b->mark = -1;
+  b->chunks = NULL;
+
+  b->bytes = 0;
+  b->chars = 0;
+  b->words = 0;
+  b->longest = 0;
+  b->widths = NULL;
+  b->widths_size = 0;
+  b->longs = NULL;
+  b->nlong = 0;
+  b->longs_cap = 0;
+  b->sel_start = b->sel_end = 0;
+  b->sel_dirty = 1;
+  b->batched = 0;
+  b->batch_first = INT_MAX;
+  b->base = NULL;
+  b->base_n = 0;
+  b->disk_valid = 0;
+  b->journal_fd = -1;
+  b->journal_path = NULL;
+  b->journal = NULL;
+  b->journal_len = b->journal_cap = 0;
+  b->journal_unsynced = 0;
+  return b;
+}
+
+// frees everything a buffer holds. the text of its rows as they were loaded
+// goes back to the pool in one step, only the rows edited since then and
+// the rows that have been drawn have anything of their own left to free
+void editorFreeBuffer(ebuf *b) {
+  int j;
+  if (E.clip_ref == b) {
+    ebuf *cur = E.buf;
+    E.buf = b;
+    editorClipDetach();
+    E.buf = cur;
+  }
+  if (E.clip_owner == b) {
+    for (j = 0; j < E.clip_numrows; j++)
+      editorRowUnpool(&E.clip[j]);
+    E.clip_owner = NULL;
+  }
+  for (j = 0; j < b->numrows; j++)
+    editorFreeRow(&b->row[j]);
+  free(b->row);
+  free(b->filename);
+  free(b->wrap_tree);
+  free(b->widths);
+  free(b->longs);
+  free(b->base);
+  if (b->journal_fd >= 0)
+    close(b->journal_fd);
+  free(b->journal_path);
+  free(b->journal);
+  editorPoolRelease(b);
+  free(b);
+}
+
+// adds a buffer to the editor and makes it the current one
+void editorAddBuffer(ebuf *b) {
+  E.bufs = realloc(E.bufs, sizeof(ebuf *) * (E.numbufs + 1));
+  E.bufs[E.numbufs] = b;
+  E.curbuf = E.numbufs++;
+  E.buf = b;
+}
+
+// makes buffer n the current one. this is just a pointer swap, inactive
+// buffers keep their render strings, highlighting and layout as they were
+void editorSwitchBuffer(int n) {
+  n = ((n % E.numbufs) + E.numbufs) % E.numbufs;
+  E.curbuf = n;
+  E.buf = E.bufs[n];
+  editorSetStatusMessage("Buffer %d/%d: %s", n + 1, E.numbufs,
+      E.buf->filename ? E.buf->filename : "[No File Name]");
+}
+
+// prompts for a file and opens it in a new buffer
+void editorOpenBuffer() {
+  char *filename = editorPrompt("Open file: %s", 0);
+  if (filename == NULL) {
+    editorSetStatusMessage("Open aborted");
+    return;
+  }
+  int prev = E.curbuf;
+  editorAddBuffer(editorNewBuffer());
+  if (editorOpen(filename) == -1) {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    editorFreeBuffer(E.buf);
+    E.numbufs--;
+    E.curbuf = prev;
+    E.buf = E.bufs[prev];
+  } else {
+    editorSetStatusMessage("Buffer %d/%d: %s", E.curbuf + 1, E.numbufs, filename);
+  }
+  free(filename);
+}
+
+// closes the current buffer, there is always at least one buffer open
+void editorCloseBuffer() {
+  ebuf *b = E.buf;
+  // its unsaved edits are being thrown away
+  editorJournalDiscard(b);
+  memmove(&E.bufs[E.curbuf], &E.bufs[E.curbuf + 1], sizeof(ebuf *) * (E.numbufs - E.curbuf - 1));
+  E.numbufs--;
+  editorFreeBuffer(b);
+  if (E.numbufs == 0) {
+    editorAddBuffer(editorNewBuffer());
+    editorSetStatusMessage("Buffer closed");
+  } else {
+    editorSwitchBuffer(E.curbuf < E.numbufs ? E.curbuf : E.numbufs - 1);
+  }
+}
+
+// returns 1 if any buffer has unsaved changes
+int editorAnyDirty() {
+  int j;
+  for (j = 0; j < E.numbufs; j++)
+    if (E.bufs[j]->dirty)
+      return 1;
+  return 0;
+}
+
+
+
 /*** append buffer ***/
 
 // this is a dynamic string type to update the screen all at once, instead of 
@@ -541,27 +3956,162 @@ void abFree(struct abuf *ab) {
 
 /*** output ***/
 
+// visual line the cursor is on in soft wrap mode, and its column within it
+int editorCursorVisualLine(int *col) {
+  if (E.buf->cy >= E.buf->numrows) {
+    *col = 0;
+    return editorWrapPrefix(E.buf->numrows);
+  }
+  erow *row = &E.buf->row[E.buf->cy];
+  editorRowHeight(E.buf->cy);
+  int line = editorRowWrapLine(row, E.buf->rx);
+  *col = E.buf->rx - editorRowWrapStart(row, line);
+  return editorWrapPrefix(E.buf->cy) + line;
+}
+
+// puts visual line 'line' at the top of the screen in soft wrap mode
+void editorWrapSetTop(int line) {
+  if (line < 0)
+    line = 0;
+  E.buf->rowoff = editorWrapFind(line, &E.buf->wrapoff);
+}
+
 // if cursor is moved off screen, modify row offset to scroll up/down
 // and modify col offset to scroll left/right 
 // boundries check to make sure you don't scroll off screen!
 void editorScroll() {
-  E.rx = 0;
-  if (E.cy < E.numrows) {
-      E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+  E.buf->rx = 0;
+  if (E.buf->cy < E.buf->numrows) {
+      E.buf->rx = editorRowCxToRx(&E.buf->row[E.buf->cy], E.buf->cx);
+  }
+
+  if (E.buf->softwrap) {
+    // scroll in visual lines, using prefix sums of the row heights
+    editorWrapEnsure();
+    E.buf->coloff = 0;
+    if (E.buf->rowoff >= E.buf->numrows)
+      E.buf->wrapoff = 0;
+    else if (E.buf->wrapoff >= editorRowHeight(E.buf->rowoff))
+      E.buf->wrapoff = E.buf->row[E.buf->rowoff].wrap_h - 1;
+    int col;
+    int cur = editorCursorVisualLine(&col);
+    int top = editorWrapPrefix(E.buf->rowoff) + E.buf->wrapoff;
+    if (cur < top)
+      editorWrapSetTop(cur);
+    else if (cur >= top + E.screenrows)
+      editorWrapSetTop(cur - E.screenrows + 1);
+    return;
   }
   
-  if (E.cy < E.rowoff) {
-    E.rowoff = E.cy;
+  if (E.buf->cy < E.buf->rowoff) {
+    E.buf->rowoff = E.buf->cy;
+  }
+  if (E.buf->cy >= E.buf->rowoff + E.screenrows) {
+    E.buf->rowoff = E.buf->cy - E.screenrows + 1;
+  }
+  if (E.buf->rx < E.buf->coloff) {
+      E.buf->coloff = E.buf->rx;
+  }
+  if (E.buf->rx >= E.buf->coloff + E.screencols) {
+      E.buf->coloff = E.buf->rx - E.screencols + 1;
   }
-  if (E.cy >= E.rowoff + E.screenrows) {
-    E.rowoff = E.cy - E.screenrows + 1;
+}
+
+// turns soft wrap mode on and off
+void editorToggleSoftWrap() {
+  E.buf->softwrap = !E.buf->softwrap;
+  E.buf->coloff = 0;
+  E.buf->wrapoff = 0;
+  // the tree isn't kept up to date while soft wrap is off
+  editorWrapInvalidate(E.buf);
+  editorSetStatusMessage("Soft wrap %s", E.buf->softwrap ? "on" : "off");
+}
+
+// re-reads the terminal size after a SIGWINCH
+void editorHandleResize() {
+  winchanged = 0;
+  int cols = E.screencols;
+  if (getWindowSize(&E.screenrows, &E.screencols) == -1) 
+    die("getWindowSize");
+  E.screenrows -= 2;
+  // wrap layouts are now stale. rows are reflowed as they come on screen,
+  // and the rest a batch at a time while the editor is idle
+  if (E.screencols != cols) {
+    int j;
+    for (j = 0; j < E.numbufs; j++)
+      editorWrapInvalidate(E.bufs[j]);
+  }
+}
+
+void handleSigWinch(int sig) {
+  (void)sig;
+  winchanged = 1;
+}
+
+// adds display columns [col, col + ncols) of a row to ab, coloring
+// the characters if the file has syntax highlighting
+void editorDrawRowSlice(struct abuf *ab, erow *row, int col, int ncols) {
+  int start, len;
+  if (row->ascii) {
+    // get the length of the current row of the file, minus any column offset
+    len = row->rsize - col;
+    if (len < 0 )
+      len = 0;
+
+    // truncate the row if it is too wide to display
+    if (len > ncols) 
+      len = ncols;
+    start = len ? col : 0;
+  } else {
+    // columns and bytes differ, find the bytes that fall within the
+    // visible columns. a wide character cut in half by the left edge
+    // is drawn as spaces
+    int over;
+    start = editorRowRenderColToIdx(row, col, &over);
+    if (over) {
+      int n;
+      int w = utf8CharWidth(&row->render[start], row->rsize - start, &n);
+      start += n;
+      while (over++ < w)
+        abAppend(ab, " ", 1);
+    }
+    len = editorRowRenderColToIdx(row, col + ncols, &over) - start;
+    if (len < 0)
+      len = 0;
   }
-  if (E.rx < E.coloff) {
-      E.coloff = E.rx;
+  char *c = &row->render[start];
+  if (E.buf->syntax == NULL) {
+    // add the row to ab
+    abAppend(ab, c, len);
+    return;
   }
-  if (E.rx >= E.coloff + E.screencols) {
-      E.coloff = E.rx - E.screencols + 1;
+
+  // add the row to ab one run of same colored characters at a time,
+  // only emitting an escape sequence when the color changes
+  unsigned char *hl = &row->hl[start];
+  int current_color = -1;
+  int j = 0;
+  while (j < len) {
+    int k = j + 1;
+    while (k < len && hl[k] == hl[j])
+      k++;
+    int color = editorSyntaxToColor(hl[j]);
+    if (color != current_color) {
+      if (color == -1) {
+        abAppend(ab, "\x1b[39m", 5);
+      } else {
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+        abAppend(ab, buf, clen);
+      }
+      current_color = color;
+    }
+    abAppend(ab, &c[j], k - j);
+    j = k;
   }
+  // <esc>[39m returns to the default text color
+  if (current_color != -1)
+    abAppend(ab, "\x1b[39m", 5);
 }
 
 // draws tildes on rows along the left hand side of the screen.
@@ -570,14 +4120,28 @@ void editorScroll() {
 // beginning at the row index filerow
 void editorDrawRows(struct abuf *ab) {
   int y;
+  // only the rows about to be drawn are highlighted, the rest are done lazily
+  editorHighlightRows(E.buf->rowoff + E.screenrows - 1);
+
+  // in soft wrap mode a row can take up several screen lines, so track
+  // which row and which of its visual lines are drawn next
+  int filerow = E.buf->rowoff;
+  int subline = E.buf->softwrap ? E.buf->wrapoff : 0;
+
+  // rows in the selection are drawn inverted
+  int selstart = 0, selend = 0;
+  if (E.buf->mark >= 0)
+    editorGetSelection(&selstart, &selend);
+
   // loop through all the availible terminal rows, print out our lines
   for (y = 0; y < E.screenrows; y++) {
-	  int filerow = y+E.rowoff;
+    if (!E.buf->softwrap)
+	  filerow = y+E.buf->rowoff;
 
   	// check to see if a row exists in our file
-    if(filerow>=E.numrows){
+    if(filerow>=E.buf->numrows){
     	// print a welcome message 1/3 down the screen if the file is empty 
-        if (E.numrows == 0 && y == E.screenrows / 3) {
+        if (E.buf->numrows == 0 && y == E.screenrows / 3) {
           char welcome[80];
           int welcomelen = snprintf(welcome, sizeof(welcome),
           "Text Editor -- version %s", TEXTEDITOR_VERSION);
@@ -601,17 +4165,26 @@ void editorDrawRows(struct abuf *ab) {
     
     } 
     } else {
-    	// get the length of the current row of the file, minus any column offset
-        int len = E.row[filerow].rsize - E.coloff;
-        if (len < 0 )
-        	len = 0;
-        
-        // truncate the row if it is too wide to display
-        if (len > E.screencols) 
-        	  len = E.screencols;
-        // add the row to ab
-        abAppend(ab, &E.row[filerow].render[E.coloff], len);
+      int selected = filerow >= selstart && filerow < selend;
+      if (selected)
+        abAppend(ab, "\x1b[7m", 4);
+      if (E.buf->softwrap) {
+        erow *row = &E.buf->row[filerow];
+        int h = editorRowHeight(filerow);
+        int start = editorRowWrapStart(row, subline);
+        int end = (subline + 1 < h) ? editorRowWrapStart(row, subline + 1) : row->rcols;
+        editorDrawRowSlice(ab, row, start, end - start);
+        if (++subline >= h) {
+          subline = 0;
+          filerow++;
+        }
+      } else {
+        editorDrawRowSlice(ab, &E.buf->row[filerow], E.buf->coloff, E.screencols);
       }
+      // <esc>[m turns the inverted colors back off
+      if (selected)
+        abAppend(ab, "\x1b[m", 3);
+    }
     // erases the rest of the line after the tilda
     abAppend(ab, "\x1b[K",3); 
     
@@ -625,15 +4198,28 @@ void editorDrawRows(struct abuf *ab) {
 void editorDrawStatusBar(struct abuf *ab) {
   // <esc>[7M inverts the colors for our status bar
   abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
+  char status[160], rstatus[80];
   // prints the file name and number of lines
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-      E.filename ? E.filename : "[No File Name]", E.numrows,
-      E.dirty ? "(modified)" : "");
+  char bufnum[32] = "";
+  if (E.numbufs > 1)
+    snprintf(bufnum, sizeof(bufnum), "[%d/%d] ", E.curbuf + 1, E.numbufs);
+  // followed by the counts for the selection if there is one, or for the whole file
+  int len;
+  if (E.buf->mark >= 0) {
+    editorSelectionStats();
+    len = snprintf(status, sizeof(status), "%s%.20s - selected %d lines, %lld words, %lld chars, %lld bytes %s",
+        bufnum, E.buf->filename ? E.buf->filename : "[No File Name]",
+        E.buf->sel_end - E.buf->sel_start, E.buf->sel_words, E.buf->sel_chars, E.buf->sel_bytes,
+        E.buf->dirty ? "(modified)" : "");
+  } else {
+    len = snprintf(status, sizeof(status), "%s%.20s - %d lines, %lld words, %lld chars, %lld bytes %s",
+        bufnum, E.buf->filename ? E.buf->filename : "[No File Name]", E.buf->numrows,
+        E.buf->words, E.buf->chars, E.buf->bytes, E.buf->dirty ? "(modified)" : "");
+  }
 
   // print the current line on the right side of the screen
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-    E.cy + 1, E.numrows);
+  int rlen = snprintf(rstatus, sizeof(rstatus), "longest %d | %s | %d/%d", E.buf->longest,
+    E.buf->syntax ? E.buf->syntax->filetype : "no ft", E.buf->cy + 1, E.buf->numrows);
   
   if (len > E.screencols) 
 	len = E.screencols;
@@ -666,6 +4252,10 @@ void editorDrawMessageBar(struct abuf *ab) {
 }
 
 void editorRefreshScreen() {
+  // nothing is drawn while a macro replays, the screen is refreshed once at the end
+  if (E.replaying)
+    return;
+
   // update the current scroll position
   editorScroll();
   
@@ -687,7 +4277,13 @@ void editorRefreshScreen() {
   
   // sets the cursor position on the screen to our stored value (cx,cy)
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+  if (E.buf->softwrap) {
+    int col;
+    int line = editorCursorVisualLine(&col) - (editorWrapPrefix(E.buf->rowoff) + E.buf->wrapoff);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", line + 1, col + 1);
+  } else {
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.buf->cy - E.buf->rowoff) + 1, (E.buf->rx - E.buf->coloff) + 1);
+  }
   abAppend(&ab, buf, strlen(buf));
 
   // re-enables the cursor after printing to screen
@@ -711,15 +4307,72 @@ void editorSetStatusMessage(const char *fmt, ...) {
 }
 
 
+/*** macros ***/
+
+// starts recording keys into a new macro, or stops the recording
+void editorToggleRecording() {
+  if (E.recording) {
+    // the Ctrl-T that stopped the recording is not part of the macro
+    E.macro_len--;
+    E.recording = 0;
+    editorSetStatusMessage("Macro recorded, %d keys. Ctrl-E = replay", E.macro_len);
+  } else {
+    E.macro_len = 0;
+    E.recording = 1;
+    editorSetStatusMessage("Recording macro. Ctrl-T = stop");
+  }
+}
+
+// replays the macro a given number of times, or with no count until the
+// cursor runs off the end of the file or stops moving down. the keys are fed
+// through editorReadKey with nothing drawn, and the rows' bookkeeping is
+// batched, so the whole replay costs one render of each row touched
+void editorReplayMacro() {
+  if (E.recording) {
+    // the Ctrl-E is not part of the macro either
+    E.macro_len--;
+    editorSetStatusMessage("Can't replay a macro while recording it");
+    return;
+  }
+  if (E.macro_len == 0) {
+    editorSetStatusMessage("No macro recorded. Ctrl-T = record");
+    return;
+  }
+  char *count = editorPrompt("Replay macro how many times (empty = to end of file): %s", 1);
+  if (count == NULL)
+    return;
+  long times = atol(count);
+  free(count);
+
+  long n = 0;
+  editorBatchBegin();
+  E.replaying = 1;
+  while (times > 0 ? n < times : E.buf->cy < E.buf->numrows) {
+    ebuf *b = E.buf;
+    int cy = b->cy;
+    E.macro_pos = 0;
+    while (E.macro_pos < E.macro_len)
+      editorProcessKey(E.macro[E.macro_pos++]);
+    n++;
+    if (times <= 0 && (E.buf != b || E.buf->cy <= cy))
+      break;
+  }
+  E.replaying = 0;
+  editorBatchEnd();
+  editorSetStatusMessage("Macro replayed %ld times", n);
+}
+
+
 /*** input ***/
 
-// prompts the user to enter text in the status bar
-char *editorPrompt(char *prompt) {
+// prompts the user to enter text in the status bar. an empty answer is
+// only accepted if allowempty is set
+char *editorPrompt(char *prompt, int allowempty) {
   size_t bufsize = 128;
   char *buf = malloc(bufsize);
   size_t buflen = 0;
   buf[0] = '\0';
-  
+  E.prompting++;
   
   // infinite loop accepts user input for a file name
   while (1) {
@@ -729,25 +4382,32 @@ char *editorPrompt(char *prompt) {
     
     //detect backspace or delete
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+          // remove the last character, including all bytes of a multibyte one
+          while (buflen != 0 && ((unsigned char)buf[buflen - 1] & 0xC0) == 0x80)
+             buflen--;
           if (buflen != 0) 
-             buf[--buflen] = '\0';
+             buflen--;
+          buf[buflen] = '\0';
         }
     // detect <esc>
     else if (c == '\x1b') {
     
           editorSetStatusMessage("");
           free(buf);
+          E.prompting--;
           return NULL;
         } 
     // detect <enter>
     else if (c == '\r') {
       // check for empty filename
-      if (buflen != 0) {
+      if (buflen != 0 || allowempty) {
         editorSetStatusMessage("");
+        E.prompting--;
         return buf;
       }
-      // test to make sure the users input does not contain special keys
-    } else if (!iscntrl(c) && c < 128) {
+      // test to make sure the users input does not contain special keys,
+      // bytes 128-255 are parts of UTF-8 characters
+    } else if (c < 256 && !iscntrl(c)) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
         buf = realloc(buf, bufsize);
@@ -762,53 +4422,85 @@ char *editorPrompt(char *prompt) {
 // scrolls if possible up and down the file
 void editorMoveCursor(int key) {
   // fetch current row, so that you cannot scroll too far to the right
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = (E.buf->cy >= E.buf->numrows) ? NULL : &E.buf->row[E.buf->cy];
   
   switch (key) {
     // moves cursor left, unless cursor is on left edge of row, 
     // then moves the cursor up a line to the end of the previous row
     case ARROW_LEFT:
-	  if (E.cx != 0) {
-	    E.cx--;
-	  } else if (E.cy > 0) {
-		E.cy--;
-		E.cx = E.row[E.cy].size;
+	  if (E.buf->cx != 0) {
+	    E.buf->cx = editorRowPrevChar(row, E.buf->cx);
+	  } else if (E.buf->cy > 0) {
+		E.buf->cy--;
+		E.buf->cx = E.buf->row[E.buf->cy].size;
 	  }
 	  break;
 	// moves cursor right, unless cursor is on right edge of row,
 	// then moves the cursor down a line to the start of the next row
     case ARROW_RIGHT:
-      if (row && E.cx < row->size) {
-        E.cx++;
-      } else if (row && E.cx == row->size) {
-        E.cy++;
-        E.cx = 0;
+      if (row && E.buf->cx < row->size) {
+        E.buf->cx = editorRowNextChar(row, E.buf->cx);
+      } else if (row && E.buf->cx == row->size) {
+        E.buf->cy++;
+        E.buf->cx = 0;
       }
       break;
     case ARROW_UP:
-      if(E.cy != 0 )
-        E.cy--;
+      if(E.buf->cy != 0 )
+        E.buf->cy--;
       break;
     case ARROW_DOWN:
-      if(E.cy < E.numrows )
-        E.cy++;
+      if(E.buf->cy < E.buf->numrows )
+        E.buf->cy++;
       break;
   }
   
   // snap cursor to end of row if user switched from a long row to a shorter row
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = (E.buf->cy >= E.buf->numrows) ? NULL : &E.buf->row[E.buf->cy];
   int rowlen = row ? row->size : 0;
-  if (E.cx > rowlen)
-    E.cx = rowlen;
+  if (E.buf->cx > rowlen)
+    E.buf->cx = rowlen;
+  // don't leave the cursor in the middle of a multibyte character
+  if (row)
+    E.buf->cx = editorRowCharStart(row, E.buf->cx);
 }
 
 
 
-//processes input from keypresses
-void editorProcessKeypress() {
+// moves the cursor and the screen by 'delta' visual lines in soft wrap mode,
+// keeping the cursor in the same screen column where possible
+void editorWrapPage(int delta) {
+  editorScroll();
+  int total = editorWrapPrefix(E.buf->numrows);
+  int col, sub;
+  int cur = editorCursorVisualLine(&col) + delta;
+  int top = editorWrapPrefix(E.buf->rowoff) + E.buf->wrapoff + delta;
+  if (cur < 0)
+    cur = 0;
+  if (cur > total)
+    cur = total;
+  if (top > total - 1)
+    top = total - 1;
+  editorWrapSetTop(top);
+
+  E.buf->cy = editorWrapFind(cur, &sub);
+  if (E.buf->cy >= E.buf->numrows) {
+    E.buf->cx = 0;
+    return;
+  }
+  erow *row = &E.buf->row[E.buf->cy];
+  int h = editorRowHeight(E.buf->cy);
+  int rx = editorRowWrapStart(row, sub) + col;
+  // don't run on into the next visual line if this one is shorter
+  if (sub + 1 < h && rx >= editorRowWrapStart(row, sub + 1))
+    rx = editorRowWrapStart(row, sub + 1) - 1;
+  E.buf->cx = editorRowRxToCx(row, rx);
+}
+
+//processes a key, read from the terminal or replayed from a macro
+void editorProcessKey(int c) {
   static int quit_presses = 1;
-  // reads in a key
-  int c = editorReadKey();
+  static int close_presses = 1;
 
   switch (c) {
     case '\r':
@@ -817,11 +4509,14 @@ void editorProcessKeypress() {
 	  
     case CTRL_KEY('q'):
 	  // if there are unsaved changes, warn the user and ask to press quit again
-	  if(E.dirty && quit_presses>0){
+	  if(editorAnyDirty() && quit_presses>0){
 		  editorSetStatusMessage("WARNING - File has unsaved changes. Press Ctrl-Q again to exit");
 		  quit_presses--;
 		  return;
 	  }
+      // unsaved edits are being thrown away, there's nothing to recover
+      while (E.numbufs > 0)
+        editorJournalDiscard(E.bufs[--E.numbufs]);
       // if user presses ctrl+q, exit the program
       write(STDOUT_FILENO, "\x1b[2J", 4); // clears the screen <esc>[2J
       write(STDOUT_FILENO, "\x1b[H", 3);  // sets cursor to top left <esc>[1;1H
@@ -831,13 +4526,64 @@ void editorProcessKeypress() {
     case CTRL_KEY('s'):
       editorSave();
       break;
+
+    case CTRL_KEY('w'):
+      editorToggleSoftWrap();
+      break;
+
+    case CTRL_KEY('b'):
+      editorToggleMark();
+      break;
+    case CTRL_KEY('x'):
+      editorCutRows();
+      break;
+    case CTRL_KEY('c'):
+      editorCopyRows();
+      break;
+    case CTRL_KEY('v'):
+      editorPasteRows();
+      break;
+
+    case CTRL_KEY('r'):
+      editorReplaceAll();
+      break;
+
+    case CTRL_KEY('u'):
+      editorSortFilter();
+      break;
+
+    case CTRL_KEY('t'):
+      editorToggleRecording();
+      break;
+    case CTRL_KEY('e'):
+      editorReplayMacro();
+      break;
+
+    case CTRL_KEY('o'):
+      editorOpenBuffer();
+      break;
+    case CTRL_KEY('n'):
+      editorSwitchBuffer(E.curbuf + 1);
+      break;
+    case CTRL_KEY('p'):
+      editorSwitchBuffer(E.curbuf - 1);
+      break;
+    case CTRL_KEY('k'):
+      // like quitting, closing a modified buffer needs a second press
+      if (E.buf->dirty && close_presses > 0) {
+        editorSetStatusMessage("WARNING - Buffer has unsaved changes. Press Ctrl-K again to close");
+        close_presses--;
+        return;
+      }
+      editorCloseBuffer();
+      break;
           
     case HOME_KEY:
-      E.cx = 0;
+      E.buf->cx = 0;
       break;
     case END_KEY:
-      if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+      if (E.buf->cy < E.buf->numrows)
+        E.buf->cx = E.buf->row[E.buf->cy].size;
       break;
     case BACKSPACE:
     case CTRL_KEY('h'):
@@ -851,12 +4597,19 @@ void editorProcessKeypress() {
     case PAGE_UP:
     case PAGE_DOWN:
     {
+      if (E.buf->softwrap) {
+        editorWrapPage(c == PAGE_UP ? -E.screenrows : E.screenrows);
+        break;
+      }
+      // the screen isn't scrolled along with the cursor during a replay
+      if (E.replaying)
+        editorScroll();
       if (c == PAGE_UP) {
-        E.cy = E.rowoff;
+        E.buf->cy = E.buf->rowoff;
       } else if (c == PAGE_DOWN) {
-        E.cy = E.rowoff + E.screenrows - 1;
-        if (E.cy > E.numrows) 
-          E.cy = E.numrows;
+        E.buf->cy = E.buf->rowoff + E.screenrows - 1;
+        if (E.buf->cy > E.buf->numrows) 
+          E.buf->cy = E.buf->numrows;
         }
       int times = E.screenrows;
       while (times--)
@@ -872,34 +4625,53 @@ void editorProcessKeypress() {
       break;
     // disables the refresh <ctrl>+l keypair and any excape sequences
     case CTRL_KEY('l'):
+      break;
+    // <esc> also drops the selection
     case '\x1b':
+      E.buf->mark = -1;
       break;
     default:
       editorInsertChar(c);
       break;
   }
   quit_presses = 1;
+  close_presses = 1;
+}
+
+//processes input from keypresses
+void editorProcessKeypress() {
+  // reads in a key
+  editorProcessKey(editorReadKey());
 }
 
 /*** init ***/
 
 void initEditor() {
   
-  // sets cursor to top left of screen
-  E.cx = 0;
-  E.cy = 0; 
-  E.rx = 0;
-  
-  E.rowoff = 0;
-  E.coloff = 0;
-  E.numrows = 0;
-  E.row = NULL;
-  E.filename = NULL;
-  
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
-  
-  E.dirty = 0;
+
+  E.pool = NULL;
+  E.poolfree = 0;
+  E.clip = NULL;
+  E.clip_numrows = 0;
+  E.clip_owner = NULL;
+  E.clip_ref = NULL;
+  E.clip_at = 0;
+
+  E.macro = NULL;
+  E.macro_len = E.macro_cap = 0;
+  E.macro_pos = 0;
+  E.recording = 0;
+  E.replaying = 0;
+  E.batch = 0;
+  E.prompting = 0;
+  E.journal_off = 0;
+
+  // start with one empty buffer
+  E.bufs = NULL;
+  E.numbufs = 0;
+  editorAddBuffer(editorNewBuffer());
   
   // determines how many rows/cols the terminal can display
   if (getWindowSize(&E.screenrows, &E.screencols) == -1) 
@@ -908,19 +4680,23 @@ void initEditor() {
   // the second-to-last row of our terminal is free to display a status bar
   // the last row will display any messages to the user
   E.screenrows -= 2;
+
+  // keep track of the terminal being resized
+  signal(SIGWINCH, handleSigWinch);
 }
 
 int main( int argc, char *argv[] ) {
   enableRawMode();
   initEditor();
 
+  // initial status message, replaced by any message about recovered edits
+  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-W = wrap");
+
   // if a filename was passed as an arg, open the file
   if( argc >= 2){
-    editorOpen(argv[1]);
+    if (editorOpen(argv[1]) == -1)
+      die("open");
   }
-  
-  // initial status message
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit");
 
   while (1) {
     editorRefreshScreen();